@@ -0,0 +1,147 @@
+/* Event manager benchmark: the cost of registering and deregistering
+ * events (and timers), and of dispatching to a large number of events
+ * every tick, each of which stays pending so the tick walks all of them.
+ * A connection-sized allocation is made next to every event, as a
+ * Socket would be, so events aren't packed together by accident.
+ *
+ * Usage: bench_events [events]   (default 10000) */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "eventmanager.h"
+
+#define CHURN_ROUNDS    200
+#define DISPATCH_TICKS  200
+/* roughly a Socket */
+#define NEIGHBOUR_SIZE  272
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long dispatched;
+
+static int writable(event e, struct event_info *info)
+{
+    dispatched++;
+    return EV_WRITE_PENDING;
+}
+
+static void fired(event_timer timer, void *context)
+{
+}
+
+static void churn(eventloop loop, int count)
+{
+    event *events = (event*)malloc(count * sizeof(event));
+    event_timer *timers = (event_timer*)malloc(count * sizeof(event_timer));
+    struct event_info info = {
+        .fd = -1,
+    };
+    int r, i;
+
+    double start = now_s();
+    for(r = 0;r < CHURN_ROUNDS;r++)
+    {
+        for(i = 0;i < count;i++)
+            event_register(loop, &info, &events[i]);
+        for(i = 0;i < count;i++)
+            event_deregister(events[i]);
+        eventmanager_tick(loop, 0);
+    }
+    double elapsed = now_s() - start;
+    printf("event register+deregister  %6.1f ns\n",
+        elapsed * 1e9 / ((double)CHURN_ROUNDS * count));
+
+    start = now_s();
+    for(r = 0;r < CHURN_ROUNDS;r++)
+    {
+        for(i = 0;i < count;i++)
+        {
+            event_timer_register(loop, fired, NULL, &timers[i]);
+            event_timer_arm(timers[i], 60000);
+        }
+        for(i = 0;i < count;i++)
+            event_timer_deregister(timers[i]);
+    }
+    elapsed = now_s() - start;
+    printf("timer register+arm+deregister  %6.1f ns\n",
+        elapsed * 1e9 / ((double)CHURN_ROUNDS * count));
+    free(timers);
+    free(events);
+}
+
+static void dispatch(eventloop loop, int count)
+{
+    event *events = (event*)malloc(count * sizeof(event));
+    int *fds = (int*)malloc(count * sizeof(int));
+    void **neighbours = (void**)malloc(count * sizeof(void*));
+    int i;
+    for(i = 0;i < count;i++)
+    {
+        fds[i] = eventfd(0, EFD_NONBLOCK);
+        if(fds[i] == -1)
+        {
+            perror("eventfd");
+            exit(1);
+        }
+        struct event_info info = {
+            .fd = fds[i],
+            .write = writable,
+        };
+        event_register(loop, &info, &events[i]);
+        neighbours[i] = malloc(NEIGHBOUR_SIZE);
+        event_modify(events[i], EV_ADD | EV_WRITE);
+    }
+
+    /* the first tick collects readiness from the backend */
+    eventmanager_tick(loop, 0);
+    dispatched = 0;
+    double start = now_s();
+    for(i = 0;i < DISPATCH_TICKS;i++)
+        eventmanager_tick(loop, 0);
+    double elapsed = now_s() - start;
+    printf("dispatch  %6.1f ns/event  (%d events)\n",
+        elapsed * 1e9 / dispatched, count);
+
+    for(i = 0;i < count;i++)
+    {
+        event_deregister(events[i]);
+        close(fds[i]);
+        free(neighbours[i]);
+    }
+    eventmanager_tick(loop, 0);
+    free(neighbours);
+    free(fds);
+    free(events);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if(count > (int)limit.rlim_cur - 64)
+        count = (int)limit.rlim_cur - 64;
+
+    eventloop loop;
+    if(eventmanager_init(&loop, EVENTMGR_BACKEND_EPOLL) != EVENTMGR_SUCCESS)
+        return 1;
+    churn(loop, count);
+    dispatch(loop, count);
+    eventmanager_cleanup(loop);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* Heap microbenchmark: put, in place reprioritise, remove and pop over
+ * nodes visited in random order, which is what defeats the cache.
+ *
+ * Usage: bench_heap [count...]   (default 10000 100000 1000000) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "heap.h"
+#include "tree.h"
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(int count)
+{
+    struct tree_node *nodes = (struct tree_node*)calloc(
+        count, sizeof(struct tree_node));
+    long long *priorities = (long long*)malloc(count * sizeof(long long));
+    int *order = (int*)malloc(count * sizeof(int));
+    int i;
+
+    /* millisecond timestamps well past what fits in an int */
+    srand(count);
+    for(i = 0;i < count;i++)
+    {
+        priorities[i] = 1700000000000LL + rand() % 1000000;
+        order[i] = i;
+    }
+    for(i = count - 1;i > 0;i--)
+    {
+        int j = rand() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    Heap heap = NEW(Heap, NULL);
+
+    double start = now_ns();
+    for(i = 0;i < count;i++)
+        CALL(heap, put, &nodes[i], priorities[i]);
+    double put = now_ns();
+    for(i = 0;i < count;i++)
+        CALL(heap, update, &nodes[order[i]], priorities[i] + 100);
+    double update = now_ns();
+    for(i = 0;i < count / 2;i++)
+        CALL(heap, remove, &nodes[order[i]]);
+    double removed = now_ns();
+    int popped = 0;
+    long long last = 0;
+    struct tree_node *n;
+    while((n = CALL(heap, pop)))
+    {
+        if(n->priority < last)
+        {
+            printf("out of order!\n");
+            break;
+        }
+        last = n->priority;
+        popped++;
+    }
+    double end = now_ns();
+
+    printf("%8d %10.1f %10.1f %10.1f %10.1f\n", count,
+        (put - start) / count,
+        (update - put) / count,
+        (removed - update) / (count / 2),
+        (end - removed) / popped);
+
+    DELETE(heap);
+    free(order);
+    free(priorities);
+    free(nodes);
+}
+
+int main(int argc, char *argv[])
+{
+    int defaults[] = { 10000, 100000, 1000000 };
+    int count = argc > 1 ? argc - 1 : 3;
+
+    printf("%8s %10s %10s %10s %10s\n",
+        "nodes", "put ns", "update ns", "remove ns", "pop ns");
+    int i;
+    for(i = 0;i < count;i++)
+        bench(argc > 1 ? atoi(argv[i + 1]) : defaults[i]);
+    return 0;
+}
@@ -0,0 +1,296 @@
+/* HTTP header parsing benchmark: parses a header-heavy request (around
+ * the size a browser sends) over and over with a fresh Http each time,
+ * once with every scanner the cpu supports, and reports MB/s and
+ * requests per second. Then does the same as a keep-alive connection
+ * would, one Http parsing pipelined batches of the request with reset
+ * in between. Compares finding the headers a proxy looks at by name
+ * against their HTTP_HEADER_* slots. Also times http_scan on its own,
+ * finding every line end through a large block of headers, and streams
+ * a large body through, with Content-Length and chunked, as socket
+ * sized buffers that share one block of memory, so nothing but the
+ * decoder is timed.
+ *
+ * Usage: bench_http [requests] [body MB]   (default 200000, 4096) */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "buffermanager.h"
+#include "http_parser.h"
+#include "http_scan.h"
+
+#define SCAN_BYTES  (64*1024*1024)
+#define LOOKUP_ROUNDS   10000000
+
+/* requests in one pipelined read */
+#define PIPELINE_DEPTH  32
+/* what a socket read hands over */
+#define BODY_BUFFER (64*1024)
+
+static const char request[] =
+    "GET /static/js/application.min.js?v=20240117 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"122\", \"Not(A:Brand\";v=\"24\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/122.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/account/settings/notifications\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=4f9c2b7e1d8a4c3b9e6f0a2d5c7b1e8f; theme=dark; "
+        "_ga=GA1.2.1234567890.1700000000; consent=analytics%3Dno\r\n"
+    "If-None-Match: \"5f3e-61a8c2b7d9e40\"\r\n"
+    "If-Modified-Since: Tue, 16 Jan 2024 09:12:44 GMT\r\n"
+    "\r\n";
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void parse(long count)
+{
+    size_t len = sizeof(request) - 1;
+    long i;
+    double start = now_s();
+    for(i = 0;i < count;i++)
+    {
+        Http http = NEW(Http);
+        buffer *b = buffer_get(len);
+        memcpy(b->ptr, request, len);
+        b->used = len;
+        CALL(http, feed_data, b);
+        int header_count;
+        if(!CALL(http, get_headers, &header_count))
+        {
+            fprintf(stderr, "request wasn't parsed\n");
+            exit(1);
+        }
+        DELETE(http);
+    }
+    double elapsed = now_s() - start;
+    printf("parse  %-7s %8.1f MB/s  %9.0f req/s\n", http_scan_name(),
+        count * len / elapsed / 1e6, count / elapsed);
+}
+
+static void pipeline(long count)
+{
+    size_t len = sizeof(request) - 1;
+    buffer *batch = buffer_get(len * PIPELINE_DEPTH);
+    int i;
+    for(i = 0;i < PIPELINE_DEPTH;i++)
+        memcpy((char*)batch->ptr + i * len, request, len);
+    batch->used = len * PIPELINE_DEPTH;
+
+    Http http = NEW(Http);
+    long parsed = 0;
+    double start = now_s();
+    while(parsed < count)
+    {
+        CALL(http, feed_data, buffer_dup(batch));
+        while(CALL(http, complete))
+        {
+            parsed++;
+            CALL(http, reset);
+        }
+        if(http->error)
+        {
+            fprintf(stderr, "pipelined request wasn't parsed\n");
+            exit(1);
+        }
+    }
+    double elapsed = now_s() - start;
+    printf("pipe   %-7s %8.1f MB/s  %9.0f req/s\n", http_scan_name(),
+        parsed * len / elapsed / 1e6, parsed / elapsed);
+    DELETE(http);
+    buffer_recycle(batch);
+}
+
+/* what routing asks every request for */
+static const char *lookup_names[] = {
+    "Host", "Content-Length", "Transfer-Encoding", "Connection", "Cookie",
+};
+#define LOOKUP_COUNT (int)(sizeof(lookup_names) / sizeof(lookup_names[0]))
+
+/* the way to find them when all there is is names */
+static struct http_header *find(Http http, const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+    for(i = 0;i < http->msg.header_count;i++)
+    {
+        struct http_header *h = &http->msg.headers[i];
+        if(h->name.len == len &&
+                strncasecmp(HTTP_SLICE_PTR(&http->msg, h->name), name, len) == 0)
+            return h;
+    }
+    return NULL;
+}
+
+static void lookup(void)
+{
+    size_t len = sizeof(request) - 1;
+    Http http = NEW(Http);
+    buffer *b = buffer_get(len);
+    memcpy(b->ptr, request, len);
+    b->used = len;
+    CALL(http, feed_data, b);
+
+    int ids[LOOKUP_COUNT];
+    int i;
+    for(i = 0;i < LOOKUP_COUNT;i++)
+        ids[i] = http_header_id(lookup_names[i], strlen(lookup_names[i]));
+
+    /* the sum keeps the lookups from being optimised out */
+    long i_round;
+    uintptr_t sum = 0;
+    double start = now_s();
+    for(i_round = 0;i_round < LOOKUP_ROUNDS;i_round++)
+        sum += (uintptr_t)find(http, lookup_names[i_round % LOOKUP_COUNT]);
+    double by_name = now_s() - start;
+    start = now_s();
+    for(i_round = 0;i_round < LOOKUP_ROUNDS;i_round++)
+        sum -= (uintptr_t)CALL(http, get_header_id, ids[i_round % LOOKUP_COUNT]);
+    double by_id = now_s() - start;
+    if(sum != 0)
+    {
+        fprintf(stderr, "lookups disagree\n");
+        exit(1);
+    }
+    printf("lookup  by name %6.1f ns  by id %6.1f ns\n",
+        by_name * 1e9 / LOOKUP_ROUNDS, by_id * 1e9 / LOOKUP_ROUNDS);
+    DELETE(http);
+}
+
+static unsigned long long body_bytes;
+static int body_done;
+
+static void on_body(Http http, buffer *b)
+{
+    body_bytes += b->used;
+    buffer_recycle(b);
+}
+
+static void on_done(Http http)
+{
+    body_done = 1;
+}
+
+static void feed(Http http, const char *p, size_t len)
+{
+    buffer *b = buffer_get(len);
+    memcpy(b->ptr, p, len);
+    b->used = len;
+    CALL(http, feed_data, b);
+}
+
+static void body(long mb, int chunked)
+{
+    /* every buffer is a whole chunk, size line to trailing CRLF */
+    char line[32];
+    size_t data = BODY_BUFFER;
+    int line_len = 0;
+    if(chunked)
+    {
+        /* four hex digits for anything near 64K */
+        data -= 2 + 6;
+        line_len = snprintf(line, sizeof(line), "%04zx\r\n", data);
+    }
+    buffer *block = buffer_get(BODY_BUFFER);
+    memcpy(block->ptr, line, line_len);
+    memset((char*)block->ptr + line_len, 'x', data);
+    memcpy((char*)block->ptr + line_len + data, "\r\n", 2);
+    block->used = BODY_BUFFER;
+
+    long count = mb * 1024 * 1024 / BODY_BUFFER;
+    char head[128];
+    int head_len;
+    if(chunked)
+        head_len = snprintf(head, sizeof(head), "POST /upload HTTP/1.1\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        head_len = snprintf(head, sizeof(head), "POST /upload HTTP/1.1\r\n"
+            "Content-Length: %llu\r\n\r\n",
+            (unsigned long long)count * BODY_BUFFER);
+
+    Http http = NEW(Http);
+    http->info.body = on_body;
+    http->info.done = on_done;
+    body_bytes = 0;
+    body_done = 0;
+    long i;
+    double start = now_s();
+    feed(http, head, head_len);
+    for(i = 0;i < count;i++)
+        CALL(http, feed_data, buffer_dup(block));
+    if(chunked)
+        feed(http, "0\r\n\r\n", 5);
+    double elapsed = now_s() - start;
+    if(!body_done || body_bytes != (unsigned long long)count * data)
+    {
+        fprintf(stderr, "body wasn't passed on\n");
+        exit(1);
+    }
+    /* the data itself isn't touched, so it's the cost per buffer that
+     * says what line rate can be kept up with */
+    printf("body   %-7s %8.1f ns per %d byte buffer\n",
+        chunked ? "chunked" : "length", elapsed * 1e9 / count, BODY_BUFFER);
+    DELETE(http);
+    buffer_recycle(block);
+}
+
+static void scan(const char *block, size_t len)
+{
+    size_t lines = 0, pos = 0;
+    double start = now_s();
+    while(pos < len)
+    {
+        pos += http_scan(block + pos, len - pos, HTTP_SET_LF) + 1;
+        lines++;
+    }
+    double elapsed = now_s() - start;
+    printf("scan   %-7s %8.1f MB/s  (%zu lines)\n", http_scan_name(),
+        len / elapsed / 1e6, lines);
+}
+
+int main(int argc, char *argv[])
+{
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+    long mb = argc > 2 ? atol(argv[2]) : 4096;
+
+    size_t len = sizeof(request) - 1;
+    size_t block_len = SCAN_BYTES / len * len;
+    char *block = (char*)malloc(block_len);
+    size_t i;
+    for(i = 0;i < block_len;i += len)
+        memcpy(block + i, request, len);
+
+    int impl;
+    for(impl = HTTP_SCAN_SCALAR;impl <= HTTP_SCAN_AVX2;impl++)
+    {
+        if(http_scan_select(impl) != 0)
+            continue;
+        scan(block, block_len);
+        parse(count);
+        pipeline(count);
+    }
+    free(block);
+    lookup();
+    body(mb, 0);
+    body(mb, 1);
+    buffer_garbage_collect(0);
+    return 0;
+}
@@ -0,0 +1,108 @@
+/* Idle connection footprint: opens connections over socketpairs, sends
+ * one small message each way on every one of them so that everything
+ * has been through its first use, then reports the heap each idle
+ * connection is left holding (from mallinfo2, kernel socket memory
+ * isn't counted) alongside the object sizes that make it up. Run it
+ * against each change to the connection state to keep track of it.
+ *
+ * Usage: bench_idle [connections]   (default 10000) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "eventmanager.h"
+#include "buffermanager.h"
+#include "sockets.h"
+
+static size_t received;
+
+static void data_available(Socket s)
+{
+    buffer *b;
+    while((b = CALL((StringIO)s, read_buffer)))
+    {
+        received += b->used;
+        buffer_recycle(b);
+    }
+}
+
+static void on_free(Socket s)
+{
+}
+
+static size_t heap_used(void)
+{
+    /* recycled buffers are allowed to sit in the pools, so they're
+     * handed back first */
+    buffer_garbage_collect(0);
+    malloc_trim(0);
+    return mallinfo2().uordblks;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+
+    /* two fds a connection */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if(count > ((int)limit.rlim_cur - 64) / 2)
+        count = ((int)limit.rlim_cur - 64) / 2;
+
+    eventloop loop;
+    if(eventmanager_init(&loop, EVENTMGR_BACKEND_EPOLL) != EVENTMGR_SUCCESS)
+        return 1;
+
+    int *peers = (int*)malloc(count * sizeof(int));
+    Socket *sockets = (Socket*)malloc(count * sizeof(Socket));
+    size_t before = heap_used();
+
+    int i;
+    for(i = 0;i < count;i++)
+    {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1)
+        {
+            perror("socketpair");
+            return 1;
+        }
+        struct socket_info info = {
+            .sock_fd = fds[0],
+            .loop = loop,
+            .data_available = data_available,
+            .on_free = on_free,
+        };
+        sockets[i] = NEW(Socket, &info);
+        peers[i] = fds[1];
+
+        CALL((StringIO)sockets[i], write, "ping", 4);
+        if(write(peers[i], "pong", 4) != 4)
+            return 1;
+    }
+    /* until every write has gone and every read has been consumed */
+    while(received < count * 4)
+        eventmanager_tick(loop, 10);
+    for(i = 0;i < 10;i++)
+        eventmanager_tick(loop, 0);
+
+    size_t after = heap_used();
+    printf("%d idle connections: %zu bytes of heap each\n",
+        count, (after - before) / count);
+    printf("  sizeof(Socket_t) %zu, sizeof(MemStringIO_t) %zu\n",
+        sizeof(Socket_t), sizeof(MemStringIO_t));
+
+    socket_free_all();
+    for(i = 0;i < count;i++)
+        close(peers[i]);
+    free(sockets);
+    free(peers);
+    eventmanager_cleanup(loop);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/* Relay benchmark: proxies a loopback TCP stream from a sending thread
+ * to a receiving one through a Relay, once spliced and once through
+ * the buffer path (forced with a transform that passes buffers through
+ * untouched), and reports throughput and the CPU time of the thread
+ * running the relay.
+ *
+ * Usage: bench_relay [MiB]   (default 2048) */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "eventmanager.h"
+#include "buffermanager.h"
+#include "sockets.h"
+#include "relay.h"
+
+#define CHUNK   (256*1024)
+
+static double now_s(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct run
+{
+    unsigned short in_port;
+    unsigned short out_port;
+    size_t total;
+    size_t received;
+    volatile int done;
+    volatile int closed;
+};
+
+static int connect_to(unsigned short port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr = { htonl(INADDR_LOOPBACK) },
+    };
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void *sender(void *arg)
+{
+    struct run *run = (struct run*)arg;
+    int fd = connect_to(run->in_port);
+    char *buf = (char*)malloc(CHUNK);
+    memset(buf, 'x', CHUNK);
+    size_t sent = 0;
+    while(sent < run->total)
+    {
+        ssize_t len = send(fd, buf, CHUNK, 0);
+        if(len <= 0)
+            break;
+        sent += len;
+    }
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void *receiver(void *arg)
+{
+    struct run *run = (struct run*)arg;
+    int fd = connect_to(run->out_port);
+    char *buf = (char*)malloc(CHUNK);
+    ssize_t len;
+    while((len = recv(fd, buf, CHUNK, 0)) > 0)
+        run->received += len;
+    free(buf);
+    close(fd);
+    run->closed = 1;
+    return NULL;
+}
+
+static buffer *pass(Relay relay, int direction, buffer *b)
+{
+    return b;
+}
+
+static void on_done(Relay relay)
+{
+    struct run *run = (struct run*)relay->info.context;
+    run->done = 1;
+}
+
+static int accept_one(int listen_fd)
+{
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    poll(&pfd, 1, -1);
+    return accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+}
+
+static unsigned short port_of(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &addr_len);
+    return ntohs(addr.sin_port);
+}
+
+static void bench(size_t total, char splice)
+{
+    struct run run = {
+        .total = total,
+    };
+    eventloop loop;
+    if(eventmanager_init(&loop, EVENTMGR_BACKEND_EPOLL) != EVENTMGR_SUCCESS)
+        exit(1);
+
+    int in_fd = socket_listen_tcp(0, 1);
+    int out_fd = socket_listen_tcp(0, 1);
+    run.in_port = port_of(in_fd);
+    run.out_port = port_of(out_fd);
+
+    pthread_t send_thread, recv_thread;
+    pthread_create(&send_thread, NULL, sender, &run);
+    pthread_create(&recv_thread, NULL, receiver, &run);
+
+    struct relay_info info = {
+        .loop = loop,
+        .a_fd = accept_one(in_fd),
+        .b_fd = accept_one(out_fd),
+        .directions = RELAY_A_TO_B,
+        .transform = splice ? NULL : pass,
+        .on_done = on_done,
+        .context = &run,
+    };
+
+    double start = now_s(CLOCK_MONOTONIC);
+    double cpu_start = now_s(CLOCK_THREAD_CPUTIME_ID);
+    Relay relay = NEW(Relay, &info);
+    while(!run.done)
+        eventmanager_tick(loop, 100);
+    DELETE(relay);
+    /* the buffer path leaves its sockets to finish flushing */
+    while(!run.closed)
+        eventmanager_tick(loop, 100);
+    pthread_join(send_thread, NULL);
+    pthread_join(recv_thread, NULL);
+    double elapsed = now_s(CLOCK_MONOTONIC) - start;
+    double cpu = now_s(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+    printf("%-7s %8.1f MB/s  relay cpu %.2fs%s\n",
+        splice ? "splice" : "buffers", run.received / elapsed / 1e6, cpu,
+        run.received == total ? "" : "  SHORT");
+
+    socket_free_all();
+    close(in_fd);
+    close(out_fd);
+    eventmanager_cleanup(loop);
+    buffer_garbage_collect(0);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = (argc > 1 ? atol(argv[1]) : 2048) * (size_t)1024*1024;
+    bench(total, 1);
+    bench(total, 0);
+    return 0;
+}
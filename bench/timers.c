@@ -0,0 +1,112 @@
+/* Compares the alarm Heap against the TimerWheel for the operations the
+ * event manager does: arming, re-arming (what read_callback does after
+ * every partial read) and expiring.
+ *
+ * Usage: bench_timers [count...]   (default 10000 100000 1000000) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heap.h"
+#include "tree.h"
+#include "timerwheel.h"
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the same pseudo random offsets for both structures */
+static long long *make_offsets(int count, int range, unsigned seed)
+{
+    long long *offsets = (long long*)malloc(count * sizeof(long long));
+    srand(seed);
+    int i;
+    for(i = 0;i < count;i++)
+        offsets[i] = rand() % range;
+    return offsets;
+}
+
+static void bench_heap(int count, long long *arm, long long *rearm)
+{
+    struct tree_node *nodes = (struct tree_node*)calloc(
+        count, sizeof(struct tree_node));
+    Heap heap = NEW(Heap, NULL);
+    int i;
+
+    double start = now_ns();
+    for(i = 0;i < count;i++)
+        CALL(heap, put, &nodes[i], arm[i]);
+    double armed = now_ns();
+    for(i = 0;i < count;i++)
+        CALL(heap, update, &nodes[i], 10000 + rearm[i]);
+    double rearmed = now_ns();
+    int expired = 0;
+    while(CALL(heap, pop))
+        expired++;
+    double end = now_ns();
+
+    printf("%-10s %8d %10.1f %10.1f %10.1f\n", "Heap", count,
+        (armed - start) / count,
+        (rearmed - armed) / count,
+        (end - rearmed) / expired);
+    DELETE(heap);
+    free(nodes);
+}
+
+static void bench_wheel(int count, long long *arm, long long *rearm)
+{
+    struct timer_node *nodes = (struct timer_node*)calloc(
+        count, sizeof(struct timer_node));
+    TimerWheel wheel = NEW(TimerWheel, 0);
+    int i;
+
+    double start = now_ns();
+    for(i = 0;i < count;i++)
+        CALL(wheel, arm, &nodes[i], arm[i]);
+    double armed = now_ns();
+    for(i = 0;i < count;i++)
+        CALL(wheel, arm, &nodes[i], 10000 + rearm[i]);
+    double rearmed = now_ns();
+    /* expire the way eventmanager_tick does, one millisecond at a time */
+    int expired = 0;
+    long long ms;
+    for(ms = 0;expired < count;ms++)
+    {
+        while(CALL(wheel, expire, ms))
+            expired++;
+    }
+    double end = now_ns();
+
+    printf("%-10s %8d %10.1f %10.1f %10.1f\n", "TimerWheel", count,
+        (armed - start) / count,
+        (rearmed - armed) / count,
+        (end - rearmed) / expired);
+    DELETE(wheel);
+    free(nodes);
+}
+
+int main(int argc, char *argv[])
+{
+    int defaults[] = { 10000, 100000, 1000000 };
+    int count = argc > 1 ? argc - 1 : 3;
+
+    printf("%-10s %8s %10s %10s %10s\n",
+        "", "timers", "arm ns", "rearm ns", "expire ns");
+    int i;
+    for(i = 0;i < count;i++)
+    {
+        int n = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+        long long *arm = make_offsets(n, 10000, 1);
+        long long *rearm = make_offsets(n, 200, 2);
+        bench_heap(n, arm, rearm);
+        bench_wheel(n, arm, rearm);
+        free(arm);
+        free(rearm);
+    }
+    return 0;
+}
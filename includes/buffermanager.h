@@ -8,6 +8,12 @@
 
 #include "list.h"
 
+/* buffers are pooled in power of two size classes from 256B to 1MiB */
+#define BUFFER_MIN_CLASS_SHIFT  8
+#define BUFFER_MAX_CLASS_SHIFT  20
+#define BUFFER_CLASS_COUNT      (BUFFER_MAX_CLASS_SHIFT - BUFFER_MIN_CLASS_SHIFT + 1)
+#define BUFFER_CLASS_SIZE(c)    ((size_t)1 << ((c) + BUFFER_MIN_CLASS_SHIFT))
+
 typedef struct
 {
     struct list_head list;
@@ -24,14 +30,81 @@ struct buffer_const
     void *const_ptr;
     size_t const_size;
     int free_buf:1;
+    /* buf was carved out of the arena */
+    int in_arena:1;
+    /* index into the pools, -1 if this buffer isn't pooled */
+    int size_class;
+    /* updated atomically, duplicates may be recycled on other threads */
     int ref_count;
     time_t last_used;
     buffer b;
 };
 
+/* per size class counters for the calling thread's pool */
+struct buffer_class_stats
+{
+    size_t size;
+    unsigned long hits;
+    unsigned long misses;
+    /* buffers exchanged with the shared depot */
+    unsigned long from_depot;
+    unsigned long to_depot;
+    /* buffers currently sitting in the free list */
+    size_t free;
+    /* bytes of this class handed out across all threads */
+    size_t in_use;
+    /* free buffers the gc is aiming to keep */
+    size_t target;
+    /* bytes released by buffer_gc_step, and bytes that had to be
+     * malloc'd again afterwards. A high ratio of the two means the
+     * pool is thrashing */
+    unsigned long long freed;
+    unsigned long long reallocated;
+};
+
 buffer *buffer_get(size_t min_size);
 buffer *buffer_dup(buffer *b);
 void buffer_recycle(buffer *buffer);
+
+/* a view of 'len' bytes at 'offset' into the data of 'b', sharing its
+ * memory. Recycle it like any other buffer. Returns NULL with errno set
+ * to EINVAL if the range isn't within b->used */
+buffer *buffer_slice(buffer *b, size_t offset, size_t len);
+/* returns 'b' if nothing else references its memory, otherwise a
+ * private copy of its contents, recycling 'b'. Call before writing
+ * into a buffer that may have been duplicated or sliced. NULL if the
+ * copy couldn't be allocated, in which case 'b' is left alone */
+buffer *buffer_make_writable(buffer *b);
 void buffer_garbage_collect(int age);
+/* one incremental gc step for the calling thread's pool: frees at most
+ * 'budget' bytes of buffers beyond what recent peak demand says the
+ * pool needs. Meant to be called often, e.g. from a short alarm.
+ * Returns the number of bytes freed */
+size_t buffer_gc_step(size_t budget);
+
+/* preallocates 'count' buffers of the class that fits 'size' into the
+ * calling thread's pool. Returns the number added, -1 if 'size' is too
+ * big to be pooled */
+int buffer_pool_warm(size_t size, int count);
+/* fills in BUFFER_CLASS_COUNT entries of 'stats' */
+void buffer_get_stats(struct buffer_class_stats *stats);
+
+/* carves pooled buffers out of one 'size' byte mapping backed by
+ * transparent huge pages, falling back to small pages if THP isn't
+ * available and to malloc once the arena is used up. Buffers that
+ * were already allocated stay on the heap. Returns 0, or -1 with errno
+ * set if the arena couldn't be mapped (buffers keep coming from malloc) */
+#define BUFFER_ARENA_PREFAULT   1   /* touch every page up front */
+#define BUFFER_ARENA_MLOCK      2   /* keep the arena resident */
+int buffer_arena_init(size_t size, int flags);
+
+/* process wide budget for buffer memory. Once more than 'high' bytes are
+ * in use buffer_memory_pressure reports 1 until usage drops to 'low'.
+ * A 'high' of 0 (the default) means no budget. buffer_get itself never
+ * fails because of the budget, it's up to producers to back off */
+void buffer_set_limit(size_t high, size_t low);
+/* bytes handed out by buffer_get and buffer_wrap and not yet recycled */
+size_t buffer_in_use(void);
+int buffer_memory_pressure(void);
 
 #endif // !BUFFERMGR_H
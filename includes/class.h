@@ -8,10 +8,12 @@
  *  #define CLASS_NAME(a,b) a## NameOfClass ##b
  *
  *  // Classes with no super-class should have 'Object' as their super class
+ *  // Fields come first, then the methods, which live in a vtable shared
+ *  // by every instance of the class
  *  CLASS(SuperClass)
- *      int METHOD(MethodName, int arg1, int arg2);
- *
  *      int fieldName;
+ *  METHODS
+ *      int METHOD(MethodName, int arg1, int arg2);
  *  END_CLASS
  *  #undef CLASS_NAME // NameOfClass
  *
@@ -72,53 +74,61 @@
  * where there's a dependency cycle */
 #define DECLARE_CLASS(name) typedef struct name *name
 
-/* declares the required typedefs, and starts defining the struct.
- * Additional members / methods are declared in the object within
- * the CLASS and END_CLASS macros */
+/* declares the required typedefs, and starts defining the instance
+ * struct. Fields are declared between CLASS and METHODS, methods
+ * between METHODS and END_CLASS. '__vtable_type__' takes up no space,
+ * it only tells CALL which vtable type goes with the object's type */
 #define CLASS(spr)                                                          \
 typedef struct CLASS_NAME(,) *CLASS_NAME(,);                                \
 typedef struct CLASS_NAME(,) CLASS_NAME(,_t);                               \
+typedef struct CLASS_NAME(,_vtable) CLASS_NAME(,_vtable_t);                 \
+typedef spr ## _vtable_t CLASS_NAME(,_super_vtable_t);                      \
 extern CLASS_NAME(,_t) CLASS_NAME(__,);                                     \
+extern CLASS_NAME(,_vtable_t) CLASS_NAME(__,_vtable);                       \
 void CLASS_NAME(__init_class_,)(void);                                      \
 struct CLASS_NAME(,) {                                                      \
     spr ## _t super;                                                        \
-    spr __super__;         
+    CLASS_NAME(,_vtable_t) *__vtable_type__[0];
+
+/* Ends the fields and starts the class' vtable */
+#define METHODS                                                             \
+};                                                                          \
+struct CLASS_NAME(,_vtable) {                                               \
+    CLASS_NAME(,_super_vtable_t) super;
 
 /* Ends a class definition */
 #define END_CLASS   };
 
-/* Used inside CLASS .. END_CLASS macros to declare a method
- * inside a class. Usage:
+/* Used between METHODS and END_CLASS to declare a method in a class.
+ * Usage:
  * return_type METHOD(method_name, arg_types...) */
 #define METHOD(name, ...)                                                   \
     (*name)(CLASS_NAME(,) this, ## __VA_ARGS__)
 
-#if 0
-#define CONSTRUCT(type, ptr, ...)                                           \
-    (__init_class_ ## type(),                                               \
-     memcpy(ptr, &__ ## type, sizeof(type ## _t)),                          \
-     (type)((void*(*)())((Object)&__ ## type)->construct)                   \
-        ((Object)ptr, ## __VA_ARGS__))
-#endif
+/* the vtable of an object, typed for the class 'me' is declared as */
+#define VTABLE(me)                                                          \
+    ((__typeof__(*(me)->__vtable_type__[0])*)((Object)(me))->__vtable__)
 
-/* Allocates memory and copies into it the class identity structure.
- * The objects constructor is also called */
+/* Allocates memory (from the class pool if it has a VPOOL) and copies
+ * into it the class identity structure, which holds the field defaults
+ * and a pointer to the vtable. The objects constructor is also called.
+ * Classes are set up before main runs, so there's nothing else to do */
 #define NEW(type, ...)                                                      \
-    (__init_class_ ## type(),                                               \
-    (type)((void*(*)())((Object)&__ ## type)->construct)(                   \
-        (Object)memdup(&__ ## type, sizeof(type ## _t)), ## __VA_ARGS__))
-
-#if 0
-#define DECONSTRUCT(obj)                                                    \
-    ((Object)obj)->deconstruct((Object)obj)
-#endif
+    ((type)((void*(*)())((Object_vtable_t*)&__ ## type ## _vtable)->construct)( \
+        (Object)__class_alloc((Object_vtable_t*)&__ ## type ## _vtable,     \
+            &__ ## type, sizeof(type ## _t)), ## __VA_ARGS__))
 
 /* Calls can objects deconstructor, and then frees the memory */
 #define DELETE(obj)                                                         \
-    (((Object)obj)->deconstruct((Object)obj),                               \
-    free(obj),                                                              \
+    (((Object)obj)->__vtable__->deconstruct((Object)obj),                   \
+    __class_free((Object)obj),                                              \
     obj = NULL)
 
+/* Frees an object without calling its deconstructor, for constructors
+ * that fail part way through */
+#define FREE(obj)                                                           \
+    __class_free((Object)obj)
+
 /* Helper to define a method implementation. Usage:
  * return_type METHOD_IMPL(method_name, method_args..)
  * {
@@ -128,37 +138,57 @@ struct CLASS_NAME(,) {                                                      \
 #define METHOD_IMPL(name, ...)                                              \
     CLASS_NAME(,_ ## name)(CLASS_NAME(,) this, ## __VA_ARGS__)
 
-/* Defines a function which sets up the 'identity' copy of this object.
- * A copy of this is taken every time an instance of the option is created.
- * VMETHOD.. and VFIELD.. helper functions fill in the methods / fields,
- * however for more complicated operations, this is merely a function. The
- * identity object is pointed to by 'this'. */
+/* Defines a function which sets up the class: its vtable, which starts
+ * as a copy of the super class' and is shared by every instance, and
+ * its 'identity' object, a copy of which is taken every time an
+ * instance is created. VMETHOD.. and VFIELD.. helper functions fill in
+ * the methods / fields, however for more complicated operations, this
+ * is merely a function. The identity object is pointed to by 'this',
+ * the vtable by '__vtable__'. It runs before main, and again (doing
+ * nothing) from any subclass' */
 #define VIRTUAL(spr)                                                        \
 CLASS_NAME(,_t) CLASS_NAME(__,);                                            \
-void CLASS_NAME(__init_class_,)() {                                         \
-    static int __initted = 0;                                               \
-    if(__initted)                                                           \
+CLASS_NAME(,_vtable_t) CLASS_NAME(__,_vtable);                              \
+static volatile int CLASS_NAME(__initted_,) = 0;                            \
+__attribute__((constructor)) void CLASS_NAME(__init_class_,)() {            \
+    /* 0: untouched, 1: being set up, 2: ready. Classes may be first        \
+     * used from several threads at once (from a dlopen'd plugin) */        \
+    if(CLASS_NAME(__initted_,) == 2)                                        \
         return;                                                             \
+    if(!__sync_bool_compare_and_swap(&CLASS_NAME(__initted_,), 0, 1))       \
+    {                                                                       \
+        while(CLASS_NAME(__initted_,) != 2);                                \
+        return;                                                             \
+    }                                                                       \
     __init_class_ ## spr();                                                 \
-    __initted = 1;                                                          \
+    CLASS_NAME(,_vtable_t) *__vtable__ = &CLASS_NAME(__,_vtable);           \
+    memcpy(&__vtable__->super, &__ ## spr ## _vtable,                       \
+        sizeof(spr ## _vtable_t));                                          \
+    /* pools are sized for one class, subclasses choose their own */         \
+    ((Object_vtable_t*)__vtable__)->__pool__ = NULL;                        \
+    ((Object_vtable_t*)__vtable__)->__super__ =                             \
+        (Object_vtable_t*)&__ ## spr ## _vtable;                            \
     CLASS_NAME(,) this = CLASS_NAME(&__,);                                  \
-    this->__super__ = &__ ## spr;                                           \
-    memcpy(&this->super, &__ ## spr, sizeof(spr ## _t));
+    memcpy(&this->super, &__ ## spr, sizeof(spr ## _t));                    \
+    ((Object)this)->__vtable__ = (Object_vtable_t*)__vtable__;
 
 /* Ends a class definition */
-#define END_VIRTUAL }
+#define END_VIRTUAL                                                         \
+    __sync_synchronize();                                                   \
+    CLASS_NAME(__initted_,) = 2;                                            \
+}
 
 /* For use between VIRTUAL .. END_VIRTUAL. Helper function to set
  * a method. Alternatively, a method can be set merely with:
- * this->method_name = method_implementation */
+ * __vtable__->method_name = method_implementation */
 #define VMETHOD(name)                                                       \
-    this->name = (void*) CLASS_NAME(,_ ## name)
+    __vtable__->name = (void*) CLASS_NAME(,_ ## name)
 
 /* For use between VIRTUAL .. END_VIRTUAL. Helper function to over-ride
  * a method. Alternatively, a method can be set merely with:
- * ((BaseClass)this)->method_name = method_implementation */
+ * ((BaseClass_vtable_t*)__vtable__)->method_name = method_implementation */
 #define VMETHOD_BASE(base, name)                                            \
-    ((base)this)->name = (void*) CLASS_NAME(,_ ## name)
+    ((base ## _vtable_t*)__vtable__)->name = (void*) CLASS_NAME(,_ ## name)
 
 /* Usage: VFIELD(name) = value; */
 #define VFIELD(name)                                                        \
@@ -166,35 +196,84 @@ void CLASS_NAME(__init_class_,)() {                                         \
 #define VFIELD_BASE(base, name)                                             \
     ((base)this)->name
 
-/* The 'NEW' macro automatically initiates a class. If the identity
- * copy of a class needs to be set up before a new instance is created
- * via 'NEW', use this */
+/* For use between VIRTUAL .. END_VIRTUAL. Has NEW and DELETE take
+ * instances of the class from and give them back to a free list instead
+ * of malloc, starting with 'prealloc' of them. With CLASS_POOL_THREAD_LOCAL
+ * every thread keeps a few of its own in front of the shared list, so
+ * most allocations don't take a lock. Reused objects hide use after free
+ * from the sanitizers, so -DCLASS_NO_POOLS turns them off */
+#ifndef CLASS_NO_POOLS
+#define VPOOL(prealloc, flags)                                              \
+    __class_pool_init((Object_vtable_t*)__vtable__,                         \
+        sizeof(CLASS_NAME(,_t)), prealloc, flags)
+#else
+#define VPOOL(prealloc, flags)
+#endif
+
+/* Fills in a struct class_pool_stats for a pooled class */
+#define POOL_STATS(type, stats)                                             \
+    __class_pool_stats((Object_vtable_t*)&__ ## type ## _vtable, stats)
+
+/* Classes are set up before main runs. Anything that needs a class
+ * before then (another constructor) can set it up early with this */
 #define INIT_CLASS(name)                                                    \
     __init_class_ ## name()
 
 /* Calls a method that doesn't exist in the class declaration
  * (i.e, it's private) */
 #define PRIV_CALL(me, func, ...)                                            \
-    CLASS_NAME(,_ ## func)(me, ## __VA_ARGS__);
+    CLASS_NAME(,_ ## func)(me, ## __VA_ARGS__)
 /* Calls a method in an objects class */
 #define CALL(me, func, ...)                                                 \
-    (me)->func(me, ## __VA_ARGS__)
-/* Calls a method that is declared by a base class of the object */
+    VTABLE(me)->func(me, ## __VA_ARGS__)
+/* Calls a method that is declared by a base class of the object, as the
+ * super class of the class being implemented has it */
 #define SUPER_CALL(base, me, func, ...)                                     \
-    ((base)(me)->__super__)->func((base)me, ## __VA_ARGS__)
+    ((base ## _vtable_t*)                                                   \
+        ((Object_vtable_t*)&CLASS_NAME(__,_vtable))->__super__)->func(      \
+        (base)me, ## __VA_ARGS__)
 
 /* The 'Object' class, which all other classes will inherit from.
  * This is defined manually as it's somewhat different to a normal class */
 typedef struct Object *Object;
 typedef struct Object Object_t;
+typedef struct Object_vtable Object_vtable_t;
 extern Object_t __Object;
+extern Object_vtable_t __Object_vtable;
 struct Object
 {
-    void *__super__;
+    Object_vtable_t *__vtable__;
+    Object_vtable_t *__vtable_type__[0];
+};
+struct Object_vtable
+{
+    Object_vtable_t *__super__;
+    /* NULL unless the class has a VPOOL */
+    struct class_pool *__pool__;
     Object (*construct)(Object);
     void (*deconstruct)(Object);
 };
 
 void __init_class_Object(void);
 
+#define CLASS_POOL_THREAD_LOCAL 1
+
+struct class_pool_stats
+{
+    size_t size;
+    /* instances that have been NEW'd and not yet DELETEd, and the most
+     * there have ever been at once. Thread local pools count a batch at
+     * a time, so the peak can miss a short spike of a few per thread */
+    unsigned long live;
+    unsigned long peak;
+    /* sitting in free lists, in every thread */
+    unsigned long cached;
+};
+
+void *__class_alloc(Object_vtable_t *vtable, void *identity, size_t size);
+void __class_free(Object obj);
+void __class_pool_init(Object_vtable_t *vtable, size_t size,
+        size_t prealloc, int flags);
+void __class_pool_stats(Object_vtable_t *vtable, struct class_pool_stats *stats);
+
 #endif
@@ -0,0 +1,100 @@
+#ifndef EVENTBACKEND_H
+#define EVENTBACKEND_H
+
+/* Internal to the event manager. This is the glue between the generic
+ * loop in eventmanager.c and the code that actually waits for fds to
+ * become ready (epoll or io_uring) */
+
+#include "list.h"
+#include "slab.h"
+#include "timerwheel.h"
+#include "eventmanager.h"
+
+struct event_backend;
+
+struct eventloop
+{
+    const struct event_backend *backend;
+    /* epoll fd or io_uring fd, -1 once cleaned up */
+    int fd;
+    void *backend_data;
+    /* the backend can do the io of EV_SUBMIT events */
+    char submits_io;
+
+    /* every event and event_timer of the loop, freed with it */
+    struct slab_cache events;
+    struct slab_cache timers;
+
+    struct list_head pending_read;
+    struct list_head pending_write;
+    struct list_head pending_removal;
+
+    TimerWheel alarms;
+};
+
+/* Laid out for dispatch: the tick, eventmanager_ready and the backends
+ * only touch the first cache line (events come from a slab, which lines
+ * them up with one) and then the callback they call */
+struct event
+{
+    struct list_head pending_read;
+    struct list_head pending_write;
+    eventloop loop;
+    /* events the backend is currently watching the fd for */
+    int backend_events;
+    /* backend operations that still reference this event. It can't be
+     * freed until they have all completed */
+    unsigned short inflight;
+    /* deregistered, and on pending_removal */
+    char removed;
+    /* fd, events and context come first, callbacks in the next line */
+    struct event_info info;
+
+    struct list_head pending_removal;
+    /* only allocated once event_alarm is used */
+    event_timer alarm;
+    /* io_uring polls and receives or accepts that haven't completed
+     * for good yet */
+    unsigned char polls;
+    unsigned char submits;
+};
+
+struct event_timer
+{
+    struct timer_node node;
+    eventloop loop;
+    void (*callback)(event_timer timer, void *context);
+    void *context;
+};
+
+struct event_backend
+{
+    const char *name;
+
+    /* sets up loop->fd and loop->backend_data */
+    int (*init)(eventloop loop);
+    void (*cleanup)(eventloop loop);
+
+    /* start / update / stop watching e->info.fd for e->info.events */
+    int (*add)(eventloop loop, event e);
+    int (*modify)(eventloop loop, event e);
+    int (*remove)(eventloop loop, event e);
+    /* queues a sendmsg, NULL unless the backend can submit io */
+    int (*send)(eventloop loop, struct event_send *send);
+
+    /* waits up to 'milliseconds' and reports anything that became
+     * ready through eventmanager_ready */
+    int (*wait)(eventloop loop, int milliseconds);
+};
+
+extern const struct event_backend epoll_backend;
+extern const struct event_backend uring_backend;
+
+/* called by a backend when the fd of 'e' is ready for 'events' */
+void eventmanager_ready(event e, int events);
+/* called by a backend with the outcome of an EV_SUBMIT receive or
+ * accept. They take care of whatever arrives after deregistration */
+void eventmanager_received(event e, buffer *b, int result);
+void eventmanager_accepted(event e, int fd);
+
+#endif // !EVENTBACKEND_H
@@ -2,7 +2,10 @@
 #ifndef EVENTMANAGER_H
 #define EVENTMANAGER_H
 
+#include <sys/socket.h>
+
 #include "list.h"
+#include "buffermanager.h"
 
 #define EVENTMGR_SUCCESS                0
 #define EVENTMGR_EPOLL_MOD_FAILED       1
@@ -11,12 +14,29 @@
 #define EVENTMGR_EPOLL_DEL_FAILED       4
 #define EVENTMGR_EPOLL_WAIT_FAILED      5
 #define EVENTMGR_NOT_INITIALIZED        6
-#define EVENTMGR_MAX                    7
+#define EVENTMGR_THREAD_FAILED          7
+#define EVENTMGR_URING_SETUP_FAILED     8
+#define EVENTMGR_URING_ENTER_FAILED     9
+#define EVENTMGR_NO_MEMORY              10
+#define EVENTMGR_NOT_SUPPORTED          11
+#define EVENTMGR_MAX                    12
+
+/* readiness is collected with epoll_wait */
+#define EVENTMGR_BACKEND_EPOLL          0
+/* poll requests, and the io of EV_SUBMIT events, are batched through
+ * an io_uring. Falls back to epoll when the kernel doesn't support
+ * what's needed */
+#define EVENTMGR_BACKEND_IO_URING       1
 
 #define EV_READ         (1<<0)
 #define EV_WRITE        (1<<1)
 #define EV_EXCEPT       (1<<2)
-#define EV_MASK         ((1<<3)-1)
+/* the loop does the fd's io itself (see eventmanager_submits_io). With
+ * EV_READ it keeps a receive, or an accept, going and hands over what
+ * it got through 'received' or 'accepted'. EV_WRITE still puts the
+ * event on the pending list for 'write', which sends with event_send */
+#define EV_SUBMIT       (1<<3)
+#define EV_MASK         ((1<<4)-1)
 
 /* add these events to the existing events */
 #define EV_ADD          (0<<16)
@@ -31,6 +51,11 @@
 #define EV_WRITE_PENDING    (1<<1)
 
 typedef struct event *event;
+/* an alarm with no fd behind it, lighter than an event */
+typedef struct event_timer *event_timer;
+/* a single reactor. Every loop owns its own epoll instance, alarms and
+ * pending lists, and must only be ticked from one thread */
+typedef struct eventloop *eventloop;
 
 struct event_info
 {
@@ -41,16 +66,62 @@ struct event_info
     int (*write)(event e,struct event_info*);
     int (*except)(event e, struct event_info*);
     int (*alarm)(event e, struct event_info*);
+    /* EV_SUBMIT only. 'b' holds what arrived and is the callback's to
+     * keep, or it's NULL with 'result' 0 at EOF or a negative errno */
+    void (*received)(event e, struct event_info*, buffer *b, int result);
+    /* EV_SUBMIT on a listening socket, a new connection's fd or a
+     * negative errno */
+    void (*accepted)(event e, struct event_info*, int fd);
+};
+
+/* a send handed to the loop with event_send. It, and everything 'msg'
+ * points to, must stay put until 'done' has been called, which it is
+ * even if the event has been deregistered in the meantime */
+struct event_send
+{
+    struct msghdr msg;
+    int flags;
+    void (*done)(struct event_send *send, int result);
+    event event;
 };
 
 const char *eventmanager_strerror(int err);
 
-int eventmanager_init(void);
-int event_register(struct event_info *event_info, struct event **event);
+int eventmanager_init(eventloop *loop, int backend);
+const char *eventmanager_backend_name(eventloop loop);
+/* non-zero if the loop's backend does io itself and takes EV_SUBMIT */
+int eventmanager_submits_io(eventloop loop);
+int event_register(eventloop loop, struct event_info *event_info,
+        struct event **event);
 int event_modify(struct event *event, int events);
 int event_alarm(struct event *event, int milliseconds);
 int event_deregister(struct event *event);
-int eventmanager_tick(int milliseconds);
-void eventmanager_cleanup(void);
+/* queues a sendmsg of send->msg on the event's fd, EV_SUBMIT only */
+int event_send(struct event *event, struct event_send *send);
+eventloop event_get_loop(struct event *event);
+
+int event_timer_register(eventloop loop,
+        void (*callback)(event_timer timer, void *context), void *context,
+        event_timer *timer);
+/* (re-)arms the timer to go off once in 'milliseconds' */
+int event_timer_arm(event_timer timer, int milliseconds);
+void event_timer_cancel(event_timer timer);
+/* frees the timer straight away, which is fine from its own callback */
+int event_timer_deregister(event_timer timer);
+
+int eventmanager_tick(eventloop loop, int milliseconds);
+void eventmanager_cleanup(eventloop loop);
+
+/* runs 'count' loops using 'backend', each on its own thread pinned to
+ * cpu (index % online cpus). 'setup' is called on the loop's thread
+ * before the first tick, 'teardown' after '*quit' becomes non-zero and
+ * before the loop is cleaned up. A non-zero return from 'setup' sets
+ * '*quit' so the other loops stop, and the call returns
+ * EVENTMGR_THREAD_FAILED. Blocks until every loop has exited */
+int eventmanager_run_threads(int count, int backend,
+        int (*setup)(eventloop loop, int index, void *context),
+        void (*teardown)(eventloop loop, int index, void *context),
+        void *context,
+        volatile int *quit);
 
 #endif // !EVENTMANAGER_H
@@ -3,21 +3,34 @@
 #define HEAP_H
 
 #include "class.h"
-#include "list.h"
 #include "tree.h"
 
 DECLARE_CLASS(Heap);
 
+/* the array stores a copy of each priority next to its node, so sifting
+ * never has to dereference the nodes themselves */
+struct heap_entry
+{
+    long long priority;
+    struct tree_node *node;
+};
+
 #define CLASS_NAME(a,b) a## Heap ##b
 CLASS(Object)
+    /* 4-ary heap, children of i are 4i+1 .. 4i+4 */
+    struct heap_entry *entries;
+    int count;
+    int capacity;
+
+    /* NULL orders by smallest priority first without an indirect call */
+    int (*comparator)(long long, long long);
+METHODS
     void METHOD(put, struct tree_node *heap, long long priority);
     struct tree_node *METHOD(pop);
     struct tree_node *METHOD(peek);
     void METHOD(remove, struct tree_node *heap);
-
-    struct list_head node_list;
-
-    int (*comparator)(long long, long long);
+    /* moves an element already in the heap to a new priority in place */
+    void METHOD(update, struct tree_node *heap, long long priority);
 END_CLASS
 #undef CLASS_NAME // Heap
 
@@ -0,0 +1,103 @@
+#ifndef HTTP_HEADERS_H
+#define HTTP_HEADERS_H
+
+#include <stddef.h>
+
+/* Header names the parser knows, given an id as the headers are
+ * scanned. The characters after the name are the first, middle
+ * (len / 2) and last of it in lower case, which is what
+ * HTTP_HEADER_HASH is taken over. They're spelled out so the hash is a
+ * constant: the hashes are the case labels of a switch, which makes a
+ * name that collides a compile error (duplicate case value). If one
+ * does, change the multipliers until it doesn't */
+#define HTTP_HEADER_LIST(X)                                                 \
+    X(HOST, "Host", 'h', 's', 't')                                          \
+    X(CONTENT_LENGTH, "Content-Length", 'c', '-', 'h')                      \
+    X(CONTENT_TYPE, "Content-Type", 'c', 't', 'e')                          \
+    X(TRANSFER_ENCODING, "Transfer-Encoding", 't', '-', 'g')                \
+    X(CONNECTION, "Connection", 'c', 'c', 'n')                              \
+    X(KEEP_ALIVE, "Keep-Alive", 'k', 'a', 'e')                              \
+    X(UPGRADE, "Upgrade", 'u', 'r', 'e')                                    \
+    X(EXPECT, "Expect", 'e', 'e', 't')                                      \
+    X(TE, "TE", 't', 'e', 'e')                                              \
+    X(TRAILER, "Trailer", 't', 'i', 'r')                                    \
+    X(ACCEPT, "Accept", 'a', 'e', 't')                                      \
+    X(ACCEPT_ENCODING, "Accept-Encoding", 'a', 'e', 'g')                    \
+    X(ACCEPT_LANGUAGE, "Accept-Language", 'a', 'l', 'e')                    \
+    X(ACCEPT_CHARSET, "Accept-Charset", 'a', 'c', 't')                      \
+    X(ACCEPT_RANGES, "Accept-Ranges", 'a', '-', 's')                        \
+    X(USER_AGENT, "User-Agent", 'u', 'a', 't')                              \
+    X(COOKIE, "Cookie", 'c', 'k', 'e')                                      \
+    X(SET_COOKIE, "Set-Cookie", 's', 'o', 'e')                              \
+    X(AUTHORIZATION, "Authorization", 'a', 'i', 'n')                        \
+    X(PROXY_AUTHORIZATION, "Proxy-Authorization", 'p', 'h', 'n')            \
+    X(PROXY_CONNECTION, "Proxy-Connection", 'p', 'n', 'n')                  \
+    X(CACHE_CONTROL, "Cache-Control", 'c', 'c', 'l')                        \
+    X(PRAGMA, "Pragma", 'p', 'g', 'a')                                      \
+    X(REFERER, "Referer", 'r', 'e', 'r')                                    \
+    X(ORIGIN, "Origin", 'o', 'g', 'n')                                      \
+    X(DATE, "Date", 'd', 't', 'e')                                          \
+    X(SERVER, "Server", 's', 'v', 'r')                                      \
+    X(LOCATION, "Location", 'l', 't', 'n')                                  \
+    X(RANGE, "Range", 'r', 'n', 'e')                                        \
+    X(IF_MODIFIED_SINCE, "If-Modified-Since", 'i', 'i', 'e')                \
+    X(IF_NONE_MATCH, "If-None-Match", 'i', 'e', 'h')                        \
+    X(IF_MATCH, "If-Match", 'i', 'a', 'h')                                  \
+    X(IF_UNMODIFIED_SINCE, "If-Unmodified-Since", 'i', 'f', 'e')            \
+    X(IF_RANGE, "If-Range", 'i', 'a', 'e')                                  \
+    X(LAST_MODIFIED, "Last-Modified", 'l', 'o', 'd')                        \
+    X(ETAG, "ETag", 'e', 'a', 'g')                                          \
+    X(EXPIRES, "Expires", 'e', 'i', 's')                                    \
+    X(VARY, "Vary", 'v', 'r', 'y')                                          \
+    X(CONTENT_ENCODING, "Content-Encoding", 'c', 'e', 'g')                  \
+    X(CONTENT_RANGE, "Content-Range", 'c', 't', 'e')                        \
+    X(CONTENT_LANGUAGE, "Content-Language", 'c', 'l', 'e')                  \
+    X(CONTENT_LOCATION, "Content-Location", 'c', 'l', 'n')                  \
+    X(CONTENT_DISPOSITION, "Content-Disposition", 'c', 'i', 'n')            \
+    X(AGE, "Age", 'a', 'g', 'e')                                            \
+    X(ALLOW, "Allow", 'a', 'l', 'w')                                        \
+    X(VIA, "Via", 'v', 'i', 'a')                                            \
+    X(FORWARDED, "Forwarded", 'f', 'a', 'd')                                \
+    X(X_FORWARDED_FOR, "X-Forwarded-For", 'x', 'r', 'r')                    \
+    X(X_FORWARDED_PROTO, "X-Forwarded-Proto", 'x', 'd', 'o')                \
+    X(X_FORWARDED_HOST, "X-Forwarded-Host", 'x', 'd', 't')                  \
+    X(X_REAL_IP, "X-Real-IP", 'x', 'a', 'p')                                \
+    X(X_REQUEST_ID, "X-Request-ID", 'x', 'e', 'd')                          \
+    X(SEC_WEBSOCKET_KEY, "Sec-WebSocket-Key", 's', 'o', 'y')                \
+    X(SEC_WEBSOCKET_VERSION, "Sec-WebSocket-Version", 's', 'k', 'n')        \
+    X(SEC_WEBSOCKET_ACCEPT, "Sec-WebSocket-Accept", 's', 'k', 't')          \
+    X(SEC_WEBSOCKET_PROTOCOL, "Sec-WebSocket-Protocol", 's', 'e', 'l')      \
+    X(SEC_WEBSOCKET_EXTENSIONS, "Sec-WebSocket-Extensions", 's', 't', 's')  \
+    X(ACCESS_CONTROL_ALLOW_ORIGIN, "Access-Control-Allow-Origin",            \
+        'a', 'l', 'n')                                                      \
+    X(STRICT_TRANSPORT_SECURITY, "Strict-Transport-Security", 's', 'p', 'y')\
+    X(WWW_AUTHENTICATE, "WWW-Authenticate", 'w', 'e', 'e')                  \
+    X(LINK, "Link", 'l', 'n', 'k')                                          \
+    X(RETRY_AFTER, "Retry-After", 'r', '-', 'r')                            \
+    X(MAX_FORWARDS, "Max-Forwards", 'm', 'r', 's')
+
+/* a perfect hash over the names above, lower cased */
+#define HTTP_HEADER_HASH(len, first, middle, last)                          \
+    (((len) + 6 * (first) + 4 * (last) + 9 * (middle)) & 511)
+
+/* longest name that can be known, names are compared this many bytes
+ * at a time */
+#define HTTP_HEADER_NAME_MAX    32
+
+enum http_header_id
+{
+    /* not one of the known names */
+    HTTP_HEADER_OTHER = 0,
+#define HTTP_HEADER_ENUM(id, name, first, middle, last) HTTP_HEADER_ ## id,
+    HTTP_HEADER_LIST(HTTP_HEADER_ENUM)
+#undef HTTP_HEADER_ENUM
+    HTTP_HEADER_COUNT
+};
+
+/* the id of the header called name[0..len), in any case, or
+ * HTTP_HEADER_OTHER */
+int http_header_id(const char *name, size_t len);
+/* how a known header is usually written, NULL for HTTP_HEADER_OTHER */
+const char *http_header_name(int id);
+
+#endif // !HTTP_HEADERS_H
@@ -6,7 +6,7 @@
 
 #include "buffermanager.h"
 #include "class.h"
-#include "stringio.h"
+#include "http_headers.h"
 
 typedef struct http *http;
 typedef void (*recycle_func)(buffer *buffer);
@@ -14,29 +14,143 @@ typedef void (*recycle_func)(buffer *buffer);
 #define HTTP_REQUEST    0
 #define HTTP_RESPONSE   1
 
+/* most header fields a message may have */
+#define HTTP_MAX_HEADERS        100
+/* most buffers a message's headers may be spread over */
+#define HTTP_MAX_BUFFERS        64
+/* most bytes of request line and headers together */
+#define HTTP_MAX_HEADER_SIZE    (32*1024)
+
+/* why a message stopped being parsed */
+#define HTTP_ERR_NONE               0
+#define HTTP_ERR_TOO_MANY_HEADERS   1
+#define HTTP_ERR_TOO_LARGE          2
+/* Content-Length or Transfer-Encoding that doesn't say where the body
+ * ends */
+#define HTTP_ERR_BAD_LENGTH         3
+#define HTTP_ERR_BAD_CHUNK          4
+/* the connection closed part way through the message */
+#define HTTP_ERR_TRUNCATED          5
+#define HTTP_ERR_NO_MEMORY          6
+
+/* how the end of the body is found */
+#define HTTP_BODY_NONE      0
+#define HTTP_BODY_LENGTH    1
+#define HTTP_BODY_CHUNKED   2
+#define HTTP_BODY_CLOSE     3
+
+/* a run of bytes in one of the message's buffers, see HTTP_SLICE_PTR */
+struct http_slice
+{
+    uint32_t offset;
+    uint16_t len;
+    /* index into msg.buffers */
+    uint16_t buf;
+};
+
+struct http_header
+{
+    struct http_slice name;
+    struct http_slice value;
+    /* HTTP_HEADER_*, HTTP_HEADER_OTHER if the name isn't a known one */
+    int id;
+};
+
 struct http_message
 {
     int direction;
-    char *http_version;
-    char *request_path;
-    char *request_type;
+    struct http_slice http_version;
+    struct http_slice request_path;
+    struct http_slice request_type;
     int response_code;
-    char *response_msg;
-    char ***headers;
+    struct http_slice response_msg;
+    struct http_header headers[HTTP_MAX_HEADERS];
     int header_count;
+    /* where the first header with each id is in 'headers', plus one so
+     * that 0 means there isn't one. See HTTP_KNOWN_HEADER */
+    uint8_t known[HTTP_HEADER_COUNT];
+    /* HTTP_BODY_*, known once the headers are complete */
+    int body;
     uint64_t content_length;
+
+    /* what the slices point into: references (buffer_dup) to the
+     * buffers that were fed in, and arena buffers that lines split
+     * between two of them were put back together in. Held until the
+     * message is done with */
+    buffer *buffers[HTTP_MAX_BUFFERS];
+    int buffer_count;
+};
+
+/* the first byte of a slice of the message 'msg' */
+#define HTTP_SLICE_PTR(msg, slice)                                          \
+    ((const char*)(msg)->buffers[(slice).buf]->ptr + (slice).offset)
+
+DECLARE_CLASS(Http);
+/* set by whoever feeds the Http, any time before the body starts. The
+ * callbacks run from inside feed_data and feed_eof, so the Http can't
+ * be DELETEd from them */
+struct http_info
+{
+    /* given the body as it arrives, in as many pieces as it was read
+     * in, each a buffer of its own to keep or recycle. They share the
+     * memory of the buffers that were fed in, nothing is copied or
+     * held on to. Without it the body is dropped */
+    void (*body)(Http http, buffer *b);
+    /* the body has ended, or parsing stopped (see 'error') */
+    void (*done)(Http http);
+    void *context;
 };
 
+/* the first header with id 'id' in the message 'msg', NULL if it has
+ * none */
+#define HTTP_KNOWN_HEADER(msg, id)                                          \
+    ((msg)->known[id] ? &(msg)->headers[(msg)->known[id] - 1] : NULL)
+
 #define CLASS_NAME(a,b) a## Http ##b
 CLASS(Object)
-    StringIO buffer;
-    struct search_state *search;
     int state;
+    /* HTTP_ERR_*, parsing stops once this is set */
+    int error;
+    /* a line that hasn't ended yet is being collected at the end of the
+     * arena, from 'partial' on */
+    buffer *arena;
+    int arena_index;
+    size_t partial;
+    char in_partial;
+    /* request line and headers so far */
+    size_t header_size;
+    /* body bytes left, of the whole body or of the current chunk */
+    uint64_t remaining;
+    int chunk_state;
+    int chunk_digits;
+    /* what was fed in after the message ended, from b->pos on. The
+     * start of the next one, parsed by reset */
+    struct list_head pending;
 
     struct http_message msg;
-
+    struct http_info info;
+METHODS
+    /* takes the buffer, whose memory the message may go on using */
     void METHOD(feed_data, buffer *b);
-    char ***METHOD(get_headers, int *header_count);
+    /* the connection has closed. Ends a body that runs until close,
+     * anything else left unfinished fails with HTTP_ERR_TRUNCATED */
+    void METHOD(feed_eof);
+    /* once the message is complete, lets go of it and starts on the
+     * next, parsing anything that was pipelined behind it. That can
+     * complete the next message straight away */
+    void METHOD(reset);
+    /* the message, body and all, has been parsed */
+    char METHOD(complete);
+    /* whether the connection can carry another message after this
+     * complete one, going by its version and Connection header */
+    char METHOD(keep_alive);
+    /* NULL until the headers are complete */
+    struct http_header *METHOD(get_headers, int *header_count);
+    /* the first header called 'name' (any case), NULL if there isn't
+     * one or the headers aren't complete */
+    struct http_header *METHOD(get_header, const char *name);
+    /* the same by HTTP_HEADER_* id, without looking through them */
+    struct http_header *METHOD(get_header_id, int id);
 END_CLASS
 #undef CLASS_NAME // Http
 
@@ -0,0 +1,34 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+
+/* scanner implementations, the best one the cpu supports is picked
+ * before main runs */
+#define HTTP_SCAN_SCALAR    0
+#define HTTP_SCAN_SSE42     1
+#define HTTP_SCAN_AVX2      2
+
+/* most bytes in a set */
+#define HTTP_SCAN_SET_MAX   4
+
+/* sets the parser looks for */
+#define HTTP_SET_EOL        "\r\n"
+#define HTTP_SET_LF         "\n"
+#define HTTP_SET_COLON      ":\r\n"
+#define HTTP_SET_SPACE      " \t"
+
+/* offset of the first byte in p[0..len) that is one of the (at most
+ * HTTP_SCAN_SET_MAX) characters of the NUL terminated 'set', len if
+ * there isn't one. Never reads outside of p[0..len) */
+size_t http_scan(const char *p, size_t len, const char *set);
+
+/* offset of the first byte that isn't a space or tab, len if none */
+size_t http_skip_space(const char *p, size_t len);
+
+/* forces an implementation, for benchmarks. Returns -1 if the cpu
+ * can't run it */
+int http_scan_select(int impl);
+const char *http_scan_name(void);
+
+#endif // !HTTP_SCAN_H
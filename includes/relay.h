@@ -0,0 +1,89 @@
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "buffermanager.h"
+#include "class.h"
+#include "eventmanager.h"
+#include "sockets.h"
+
+/* which ways a relay forwards */
+#define RELAY_A_TO_B    1
+#define RELAY_B_TO_A    2
+#define RELAY_BOTH      (RELAY_A_TO_B | RELAY_B_TO_A)
+
+/* bytes a relay's kernel pipes are asked to hold, per direction */
+#define RELAY_PIPE_SIZE (256*1024)
+
+DECLARE_CLASS(Relay);
+struct relay_info
+{
+    eventloop loop;
+    /* each end is a Socket, or with the Socket NULL, the fd: a socket,
+     * pipe or regular file (but not both ends files). The relay owns
+     * both ends from here on, even if it fails, and a Socket's own
+     * callbacks and context are replaced */
+    Socket a;
+    int a_fd;
+    Socket b;
+    int b_fd;
+    /* RELAY_* directions, a direction left out has its receiving end
+     * closed for writing straight away */
+    int directions;
+    /* optional. Every buffer is passed through this on its way across,
+     * which means taking the buffer path instead of splicing. Returns
+     * what to send on in its place, or NULL to drop it */
+    buffer *(*transform)(Relay relay, int direction, buffer *b);
+    /* called once every direction has passed on its EOF, or something
+     * failed (see 'error'). The relay may be DELETEd from here */
+    void (*on_done)(Relay relay);
+    void *context;
+};
+
+struct relay_end
+{
+    /* buffer path */
+    Socket socket;
+    /* what's left of a Socket whose fd was taken for splicing */
+    Socket detached;
+    /* splice path. 'event' is NULL for a regular file, which is always
+     * ready */
+    int fd;
+    event event;
+    char is_socket;
+};
+
+/* one direction */
+struct relay_flow
+{
+    struct relay_end *from;
+    struct relay_end *to;
+    /* splice path: read end, write end, and what's sitting in it */
+    int pipe[2];
+    size_t piped;
+    size_t pipe_size;
+    char active:1,
+         eof:1,
+         done:1;
+    unsigned long long bytes;
+};
+
+#define CLASS_NAME(a,b) a## Relay ##b
+CLASS(Object)
+    struct relay_end ends[2];
+    /* a to b, b to a */
+    struct relay_flow flows[2];
+    /* 0 when going through buffers */
+    char splicing:1,
+         finished:1;
+    /* errno of whatever stopped the relay early, or 0 */
+    int error;
+
+    struct relay_info info;
+METHODS
+    /* bytes forwarded in one direction so far */
+    unsigned long long METHOD(bytes, int direction);
+END_CLASS
+#undef CLASS_NAME
+
+#endif // !RELAY_H
@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "list.h"
+
+/* slabs are allocated aligned to their size, so any object finds its
+ * slab by masking its address */
+#define SLAB_SIZE           (16*1024)
+/* objects of at least this size are padded to a multiple of it, and
+ * all of them start from a boundary of it */
+#define SLAB_CACHE_LINE     64
+/* completely free slabs held on to, to ride out churn */
+#define SLAB_KEEP_EMPTY     1
+
+/* Fixed size objects carved out of SLAB_SIZE blocks. Not thread safe,
+ * whatever owns the cache (e.g. an event loop) has to keep to its own
+ * thread. With -DSLAB_MALLOC every object is its own malloc instead, so
+ * the sanitizers can see use after free */
+struct slab_cache
+{
+    size_t size;
+    /* slabs with free objects, and ones without */
+    struct list_head partial;
+    struct list_head full;
+    int empty;
+
+    unsigned long slabs;
+    /* objects allocated, not counted with SLAB_MALLOC */
+    unsigned long used;
+};
+
+void slab_cache_init(struct slab_cache *cache, size_t size);
+/* frees every slab, whether or not its objects were freed */
+void slab_cache_destroy(struct slab_cache *cache);
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(void *obj);
+
+#endif // !SLAB_H
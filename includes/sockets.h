@@ -7,33 +7,114 @@
 #include "stringio.h"
 #include "eventmanager.h"
 
+/* size of the buffers sockets read into */
+#define SOCKET_BUFFER_SIZE      (16*1024)
+
 DECLARE_CLASS(Socket);
+struct socket_send;
 struct socket_info
 {
     int sock_fd;
+    /* the loop this socket's events are registered with */
+    eventloop loop;
     void *context;
     void (*data_available)(Socket socket);
     void (*on_free)(Socket socket);
+    /* optional, called once the write queue has drained to the low
+     * watermark after having hit the high one */
+    void (*write_drained)(Socket socket);
+    /* high watermark for each of the read and write queues, the low one
+     * is half of it. 0 for SOCKET_DEFAULT_MAX_MEM */
+    size_t max_mem;
+    /* delivery policy, see set_delivery */
+    size_t deliver_bytes;
+    unsigned int deliver_delay;
+    /* writes of at least this many bytes are sent with MSG_ZEROCOPY,
+     * 0 to always copy */
+    size_t zerocopy_threshold;
+};
+
+/* how long read data waited before data_available was called */
+struct socket_delivery_stats
+{
+    unsigned long deliveries;
+    unsigned long long total_us;
+    unsigned long long max_us;
 };
 
+/* reasons reading from a socket can be paused */
+#define SOCKET_PAUSE_BUFFERED   1   /* read queue is over its watermark */
+#define SOCKET_PAUSE_PRESSURE   2   /* buffer manager is over budget */
+#define SOCKET_PAUSE_USER       4   /* pause_read was called */
+
 #define CLASS_NAME(a,b) a## Socket ##b
 CLASS(StringIO)
     struct list_head list;
 
-    MemStringIO __read_buffers;
-    MemStringIO __write_buffers;
-    Pipe read_queue;
-    Pipe write_queue;
+    /* NULL while empty */
+    MemStringIO read_queue;
+    MemStringIO write_queue;
 
     event event;
 
     char flag_eof:1,
-         write_closed:1;
+         write_closed:1,
+         write_full:1,
+         /* the loop does the reading and writing (EV_SUBMIT) */
+         submit_io:1;
+    /* with submit_io, the send the loop has in flight. It outlives the
+     * socket if need be */
+    struct socket_send *send;
+    /* SOCKET_PAUSE_* flags, EV_READ is off while any are set */
+    int read_paused;
+    size_t mem_high;
+    size_t mem_low;
+    /* how much the next read asks for, and how many reads in a row
+     * have come up well short of it */
+    size_t recv_size;
+    int small_reads;
 
-    char METHOD(eof);
-    void METHOD(send_eof);
+    size_t deliver_bytes;
+    /* us, 0 when every read is delivered straight away */
+    unsigned int deliver_delay;
+    /* when the oldest undelivered byte was read (us), 0 if none are */
+    long long pending_since;
+    size_t undelivered;
+    struct socket_delivery_stats delivery;
+
+    size_t zerocopy_threshold;
+    /* number the kernel will give the next zerocopy send */
+    uint32_t zerocopy_seq;
+    /* sends the kernel may still be reading buffers for, oldest first */
+    struct list_head zerocopy_pending;
+    unsigned long zerocopy_sends;
+    /* sends the kernel ended up copying anyway (always on loopback) */
+    unsigned long zerocopy_copied;
 
     struct socket_info info;
+METHODS
+    char METHOD(eof);
+    void METHOD(send_eof);
+    /* lets a consumer that can't keep up stop the socket reading. With
+     * submit_io, what the loop had already received is still delivered */
+    void METHOD(pause_read);
+    void METHOD(resume_read);
+    /* 0 while the write queue is over its high watermark, producers
+     * should hold off until write_drained is called */
+    char METHOD(writable);
+    /* bytes queued in both directions */
+    size_t METHOD(mem_used);
+    /* when to call data_available after a read: with 'bytes' of 0 it's
+     * called straight away, otherwise once 'bytes' have arrived or the
+     * oldest of them has waited 'delay_us', whichever is first. A
+     * 'delay_us' of 0 means the default of 100ms */
+    void METHOD(set_delivery, size_t bytes, unsigned int delay_us);
+    /* stops the socket doing any io of its own and hands its fd over,
+     * leaving an object that only needs DELETEing (on_free is still
+     * called). Fails with EBUSY while anything is queued either way, and
+     * always with submit_io, where a receive is kept pending and what it
+     * took would be lost */
+    int METHOD(detach);
 END_CLASS
 #undef CLASS_NAME
 
@@ -47,6 +128,53 @@ int socket_write_buffer(smpsocket s, buffer *b);
 void socket_send_eof(smpsocket s);
 void socket_free(smpsocket s);
 #endif
+/* frees every socket created on the calling thread */
 void socket_free_all(void);
+/* delivery counters summed over every socket the calling thread has had */
+void socket_get_delivery_stats(struct socket_delivery_stats *stats);
+
+/* most connections a Listener takes per wakeup */
+#define LISTENER_DEFAULT_BATCH  64
+/* seconds the kernel holds on to a connection waiting for its first data */
+#define LISTENER_DEFAULT_DEFER  10
+
+DECLARE_CLASS(Listener);
+struct listener_info
+{
+    eventloop loop;
+    unsigned short port;
+    /* listen() backlog, 0 for SOMAXCONN */
+    int backlog;
+    /* TCP_DEFER_ACCEPT seconds, 0 for LISTENER_DEFAULT_DEFER or -1 to
+     * take connections as soon as the handshake is done. Only suits
+     * protocols where the client speaks first */
+    int defer_accept;
+    /* 0 for LISTENER_DEFAULT_BATCH */
+    int batch;
+    void *context;
+    /* fills in the socket_info for a new connection, which comes with
+     * sock_fd, loop and context (the listener's) set. Returning -1 turns
+     * the connection away */
+    int (*on_accept)(Listener listener, struct socket_info *info);
+};
+
+/* accepts connections on a TCP port and makes a Socket for each of them */
+#define CLASS_NAME(a,b) a## Listener ##b
+CLASS(Object)
+    int fd;
+    event event;
+    int batch;
+    unsigned long accepted;
+
+    struct listener_info info;
+METHODS
+END_CLASS
+#undef CLASS_NAME
+
+/* creates a non-blocking listening TCP socket with SO_REUSEPORT set,
+ * so that every event loop can listen on the same port and let the
+ * kernel spread incoming connections between them. Returns the fd,
+ * or -1 with errno set */
+int socket_listen_tcp(unsigned short port, int backlog);
 
 #endif // !SOCKETS_H
@@ -2,10 +2,13 @@
 #ifndef STRINGIO_H
 #define STRINGIO_H
 
+#include <sys/uio.h>
+
 #include "class.h"
 
 #define CLASS_NAME(a,b) a## StringIO ##b
 CLASS(Object)
+METHODS
     size_t METHOD(read, void *buf, size_t len);
     size_t METHOD(write, void *buf, size_t len);
 
@@ -29,15 +32,13 @@ CLASS(StringIO)
     size_t total_size;
 
     size_t new_buffer_size;
-
+METHODS
     buffer *METHOD(get_current_buffer);
     void METHOD(update_current_buffer, size_t len);
-END_CLASS
-#undef CLASS_NAME
-
-#define CLASS_NAME(a,b) a## Pipe ##b
-CLASS(StringIO)
-    StringIO    base;
+    /* fills in up to 'count' iovecs with the data from the start of
+     * the stream onwards, for a single writev / sendmsg. Returns the
+     * number filled in */
+    int METHOD(get_iovec, struct iovec *iov, int count);
 END_CLASS
 #undef CLASS_NAME
 
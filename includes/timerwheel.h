@@ -0,0 +1,50 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#include "class.h"
+#include "list.h"
+
+/* 4 levels of 64 slots at 1ms resolution: level 0 covers the next 64ms,
+ * level 3 a little over 4.6 hours. Timers further out than that sit in
+ * the last level and are re-filed each time it cascades */
+#define TIMERWHEEL_LEVELS       4
+#define TIMERWHEEL_SLOT_BITS    6
+#define TIMERWHEEL_SLOTS        (1<<TIMERWHEEL_SLOT_BITS)
+
+struct timer_node
+{
+    struct list_head list;
+    long long expires;
+    /* level * TIMERWHEEL_SLOTS + index, or -1 when on the expired list */
+    int slot;
+    /* the wheel this timer is armed in, NULL if it isn't */
+    void *ctxt;
+};
+
+DECLARE_CLASS(TimerWheel);
+
+#define CLASS_NAME(a,b) a## TimerWheel ##b
+CLASS(Object)
+    /* the next millisecond that hasn't been processed yet */
+    long long current;
+    int count;
+    uint64_t occupied[TIMERWHEEL_LEVELS];
+    struct list_head expired;
+    struct list_head slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+METHODS
+    /* (re-)arms 'timer' to expire at 'expires' ms. O(1) */
+    void METHOD(arm, struct timer_node *timer, long long expires);
+    /* disarms 'timer' if it's armed. O(1) */
+    void METHOD(cancel, struct timer_node *timer);
+    /* removes and returns one timer that is due at 'now', NULL when
+     * there are none left */
+    struct timer_node *METHOD(expire, long long now);
+    /* a lower bound on when the next timer is due, -1 if none are armed.
+     * Timers in the upper levels are reported at their cascade time */
+    long long METHOD(next_expiry);
+END_CLASS
+#undef CLASS_NAME // TimerWheel
+
+#endif // !TIMERWHEEL_H
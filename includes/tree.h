@@ -12,9 +12,9 @@ struct tree_node
     int magic;
 #endif
     long long priority;
-    struct tree_node *parent;
-    struct tree_node *children[2];
-    struct list_head list;
+    /* slot in the owning heap's array, which doubles as the handle
+     * used by remove / update */
+    int index;
     void *ctxt;
 };
 
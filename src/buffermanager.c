@@ -1,51 +1,386 @@
-
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "list.h"
 #include "buffermanager.h"
 
 #include "debug.h"
 
-/** TODO:
-  sort these in a self balancing binary tree by buffer size
-*/
+/* Buffers are pooled by power of two size class, each class with its
+ * own LIFO free list: buffer_get is O(1), never hands out more than
+ * twice what was asked for, and prefers the most recently recycled
+ * (and so most likely cache-hot) buffer. Anything bigger than the
+ * largest class is malloc'd and freed on demand.
+ *
+ * Every thread keeps its own free lists (its magazines) so the common
+ * path never takes a lock. When a thread's list for a class grows past
+ * two magazines' worth, the coldest magazine is handed to a shared
+ * depot in one go, and a thread that runs dry takes a whole magazine
+ * back before falling back to malloc. A buffer recycled on a different
+ * thread to the one that got it simply joins the recycling thread's
+ * magazine, and finds its way back through the depot from there. */
+
+/* a batch of free buffers (or metadata) on its way through the depot */
+struct magazine
+{
+    struct list_head list;
+    struct list_head items;
+    int count;
+};
+
+struct depot
+{
+    pthread_mutex_t lock;
+    /* most recently deposited at the head */
+    struct list_head full;
+    int count;
+};
+
+struct size_class
+{
+    /* most recently recycled at the head, oldest at the tail */
+    struct list_head free;
+    struct buffer_class_stats stats;
+
+    /* buffers of this class the thread has out right now, and the most
+     * it had out since the last gc step. Can go negative when buffers
+     * are recycled on other threads */
+    long outstanding;
+    long peak;
+    /* decaying maximum of 'peak' in 1/16ths */
+    long demand;
+    /* buffers buffer_pool_warm asked to keep around regardless */
+    long reserve;
+    /* bytes freed by the gc that haven't been allocated again yet */
+    size_t gc_credit;
+};
+
+/* total size of the buffers moved in one magazine, though never fewer
+ * than 2 or more than 32 */
+#define MAGAZINE_BYTES      (1024*1024)
+#define MAGAZINE_MAX        32
+#define MAGAZINE_MIN        2
+#define META_MAGAZINE_SIZE  64
+
+/* the demand estimate jumps straight up to a new peak, and each gc
+ * step decays it 1/32 of the way back down */
+#define DEMAND_SHIFT        5
+/* return freed memory to the OS once this much has been freed */
+#define TRIM_THRESHOLD      (4*1024*1024)
+
+static __thread struct size_class classes[BUFFER_CLASS_COUNT];
+static __thread struct list_head avail_meta;
+static __thread int avail_meta_count;
+/* an emptied magazine, kept for the next flush to the depot */
+static __thread struct magazine *spare;
+/* bytes freed since malloc_trim last ran */
+static __thread size_t untrimmed;
+
+#define DEPOT_INIT { PTHREAD_MUTEX_INITIALIZER, { NULL, NULL }, 0 }
+static struct depot depots[BUFFER_CLASS_COUNT] = {
+    [0 ... BUFFER_CLASS_COUNT - 1] = DEPOT_INIT
+};
+static struct depot meta_depot = DEPOT_INIT;
+
+/* bytes handed out and not yet recycled, shared by every thread. The
+ * last entry counts buffers that aren't pooled */
+static size_t in_use[BUFFER_CLASS_COUNT + 1];
+static size_t limit_high, limit_low;
+static volatile int pressure;
 
-static LIST_HEAD(free_buffers);
-static LIST_HEAD(avail_meta);
+#define USAGE_SLOT(class) ((class) < 0 ? BUFFER_CLASS_COUNT : (class))
+
+static inline void init_pools(void)
+{
+    if(avail_meta.next == NULL)
+    {
+        int i;
+        for(i = 0;i < BUFFER_CLASS_COUNT;i++)
+        {
+            INIT_LIST_HEAD(&classes[i].free);
+            memset(&classes[i].stats, '\0', sizeof(classes[i].stats));
+            classes[i].stats.size = BUFFER_CLASS_SIZE(i);
+        }
+        INIT_LIST_HEAD(&avail_meta);
+        avail_meta_count = 0;
+    }
+}
+
+static inline void lock_depot(struct depot *d)
+{
+    pthread_mutex_lock(&d->lock);
+    if(d->full.next == NULL)
+        INIT_LIST_HEAD(&d->full);
+}
+
+/* smallest class that fits 'size', or -1 if none do */
+static inline int size_class(size_t size)
+{
+    if(size <= BUFFER_CLASS_SIZE(0))
+        return 0;
+    int shift = 64 - __builtin_clzll((unsigned long long)size - 1);
+    if(shift > BUFFER_MAX_CLASS_SHIFT)
+        return -1;
+    return shift - BUFFER_MIN_CLASS_SHIFT;
+}
+
+static inline int magazine_size(int class)
+{
+    int size = MAGAZINE_BYTES >> (class + BUFFER_MIN_CLASS_SHIFT);
+    if(size > MAGAZINE_MAX)
+        return MAGAZINE_MAX;
+    if(size < MAGAZINE_MIN)
+        return MAGAZINE_MIN;
+    return size;
+}
+
+/* moves the 'count' entries at the tail of 'head' into the depot. The
+ * list is only walked outside the lock */
+static int depot_put(struct depot *d, struct list_head *head, int count)
+{
+    struct magazine *m = spare;
+    spare = NULL;
+    if(m == NULL)
+    {
+        m = (struct magazine*)malloc(sizeof(struct magazine));
+        if(m == NULL)
+            return 0;
+    }
+
+    INIT_LIST_HEAD(&m->items);
+    int n;
+    for(n = 0;n < count && !list_empty(head);n++)
+        list_move(head->prev, &m->items);
+    m->count = n;
+
+    lock_depot(d);
+    list_add(&m->list, &d->full);
+    __atomic_store_n(&d->count, d->count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+/* moves a magazine from the depot onto the front of 'head'. Returns the
+ * number of entries moved, 0 if the depot is empty */
+static int depot_get(struct depot *d, struct list_head *head)
+{
+    /* unlocked peek, the worst it can do is send us to malloc */
+    if(__atomic_load_n(&d->count, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    lock_depot(d);
+    struct magazine *m = NULL;
+    if(!list_empty(&d->full))
+    {
+        m = list_first(struct magazine, &d->full, list);
+        list_del(&m->list);
+        __atomic_store_n(&d->count, d->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&d->lock);
+    if(m == NULL)
+        return 0;
+
+    int n = m->count;
+    list_splice(&m->items, head);
+    if(spare == NULL)
+        spare = m;
+    else
+        free(m);
+    return n;
+}
 
 static buffer *get_meta()
 {
+    init_pools();
     if(list_empty(&avail_meta))
     {
-        return (buffer*)malloc(sizeof(buffer));
+        avail_meta_count += depot_get(&meta_depot, &avail_meta);
+        if(list_empty(&avail_meta))
+            return (buffer*)malloc(sizeof(buffer));
     }
-    else
+
+    buffer *b = list_first(buffer, &avail_meta, list);
+    ASSERT((void*)b != (void*)&avail_meta)
+    list_del(&b->list);
+    avail_meta_count--;
+    return b;
+}
+
+static void put_meta(buffer *b)
+{
+    list_add(&b->list, &avail_meta);
+    if(++avail_meta_count >= 2 * META_MAGAZINE_SIZE)
+        avail_meta_count -= depot_put(&meta_depot, &avail_meta,
+            META_MAGAZINE_SIZE);
+}
+
+/* The optional arena: one big mapping, backed by transparent huge pages
+ * where the kernel allows it, that pooled buffers are carved out of
+ * instead of coming from malloc. Each size class takes 2MiB chunks of
+ * it at a time, so buffers of a class sit next to each other and a
+ * chunk never needs more than one huge page TLB entry. Buffers freed by
+ * the gc go onto a per-class list for reuse, the arena itself is never
+ * unmapped */
+#define ARENA_CHUNK     (2*1024*1024)
+
+struct arena_class
+{
+    char *next;
+    char *end;
+    /* headers of buffers the gc has released, data still in the arena */
+    struct list_head released;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    char *base;
+    size_t size;
+    size_t used;
+    int flags;
+    /* MADV_HUGEPAGE was accepted */
+    int huge;
+    struct arena_class classes[BUFFER_CLASS_COUNT];
+} arena = { PTHREAD_MUTEX_INITIALIZER };
+
+int buffer_arena_init(size_t size, int flags)
+{
+    if(arena.base != NULL)
     {
-        buffer *b = list_first(buffer, &avail_meta, list);
-        ASSERT((void*)b != (void*)&avail_meta)
-        list_del(&b->list);
-        return b;
+        errno = EEXIST;
+        return -1;
+    }
+    size = (size + ARENA_CHUNK - 1) & ~(size_t)(ARENA_CHUNK - 1);
+
+    /* over-map so the arena can start on a huge page boundary */
+    size_t map_size = size + ARENA_CHUNK;
+    char *map = (char*)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        DPRINTF("unable to map buffer arena: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    char *base = (char*)(((uintptr_t)map + ARENA_CHUNK - 1) &
+        ~(uintptr_t)(ARENA_CHUNK - 1));
+    if(base != map)
+        munmap(map, base - map);
+    if(base + size != map + map_size)
+        munmap(base + size, (map + map_size) - (base + size));
+
+    arena.huge = madvise(base, size, MADV_HUGEPAGE) == 0;
+    if(!arena.huge)
+        DPRINTF("no transparent huge pages for buffer arena: %s (%d)\n",
+            strerror(errno), errno);
+
+    if(flags & BUFFER_ARENA_MLOCK)
+    {
+        /* mlock faults everything in as well */
+        if(mlock(base, size) == -1)
+        {
+            DPRINTF("unable to lock buffer arena: %s (%d)\n",
+                strerror(errno), errno);
+            flags &= ~BUFFER_ARENA_MLOCK;
+        }
+    }
+    if((flags & BUFFER_ARENA_PREFAULT) && !(flags & BUFFER_ARENA_MLOCK))
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t off;
+        for(off = 0;off < size;off += page)
+            ((volatile char*)base)[off] = 0;
     }
+
+    int c;
+    for(c = 0;c < BUFFER_CLASS_COUNT;c++)
+    {
+        arena.classes[c].next = arena.classes[c].end = NULL;
+        INIT_LIST_HEAD(&arena.classes[c].released);
+    }
+    arena.size = size;
+    arena.used = 0;
+    arena.flags = flags;
+    __sync_synchronize();
+    arena.base = base;
+    return 0;
 }
 
-buffer *buffer_get(size_t min_size)
+/* a buffer of 'class' from the arena, or NULL once it's exhausted */
+static struct buffer_const *arena_alloc(int class)
 {
     struct buffer_const *i;
-    list_for_each_entry(i, &free_buffers, list)
+    struct arena_class *ac = &arena.classes[class];
+    size_t size = BUFFER_CLASS_SIZE(class);
+
+    pthread_mutex_lock(&arena.lock);
+    if(!list_empty(&ac->released))
     {
-        if(min_size <= i->const_size)
+        i = list_first(struct buffer_const, &ac->released, list);
+        list_del(&i->list);
+        pthread_mutex_unlock(&arena.lock);
+        i->list.next = i->list.prev = NULL;
+        return i;
+    }
+    if(ac->next == ac->end)
+    {
+        if(arena.used + ARENA_CHUNK > arena.size)
         {
-            i->ref_count = 1;
-            list_del(&i->list);
-            return &i->b;
+            pthread_mutex_unlock(&arena.lock);
+            return NULL;
         }
+        ac->next = arena.base + arena.used;
+        ac->end = ac->next + ARENA_CHUNK;
+        arena.used += ARENA_CHUNK;
     }
+    /* headers come from malloc so that buffer data stays page aligned */
+    i = (struct buffer_const*)malloc(sizeof(struct buffer_const));
+    if(i == NULL)
+    {
+        pthread_mutex_unlock(&arena.lock);
+        return NULL;
+    }
+    i->const_ptr = ac->next;
+    ac->next += size;
+    pthread_mutex_unlock(&arena.lock);
+
+    i->const_size = size;
+    i->free_buf = 0;
+    i->in_arena = 1;
+    i->size_class = class;
+    i->list.next = i->list.prev = NULL;
+    i->b.orig = i;
+    return i;
+}
+
+static void arena_release(struct buffer_const *i)
+{
+    /* give the pages back, unless they're locked or that would split a
+     * huge page */
+    if(!arena.huge && !(arena.flags & BUFFER_ARENA_MLOCK) &&
+            i->const_size >= (size_t)sysconf(_SC_PAGESIZE))
+        madvise(i->const_ptr, i->const_size, MADV_DONTNEED);
+
+    pthread_mutex_lock(&arena.lock);
+    list_add(&i->list, &arena.classes[i->size_class].released);
+    pthread_mutex_unlock(&arena.lock);
+}
 
-    /* round up to nearest 256B */
-    size_t buffer_size = ((min_size-1) & (~0xFF)) + 0x100;
-    i = (struct buffer_const*)malloc(
+static struct buffer_const *buffer_alloc(size_t buffer_size, int class)
+{
+    if(class >= 0 && arena.base != NULL)
+    {
+        struct buffer_const *i = arena_alloc(class);
+        if(i != NULL)
+            return i;
+        /* arena's full, fall back to the heap */
+    }
+
+    struct buffer_const *i = (struct buffer_const*)malloc(
         sizeof(struct buffer_const) +
         buffer_size);
 
@@ -56,11 +391,71 @@ buffer *buffer_get(size_t min_size)
     }
 
     buffer *b = &i->b;
-    i->const_ptr  = b->ptr  = (void*)(b+1);
-    i->const_size = b->size = buffer_size;
+    i->const_ptr  = (void*)(b+1);
+    i->const_size = buffer_size;
     i->free_buf = 0; // buf is part of this allocation
-    i->ref_count = 1;
+    i->in_arena = 0;
+    i->size_class = class;
     i->list.next = i->list.prev = NULL;
+    b->orig = i;
+    return i;
+}
+
+buffer *buffer_get(size_t min_size)
+{
+    struct buffer_const *i;
+    init_pools();
+
+    int class = size_class(min_size);
+    size_t buffer_size;
+    if(class >= 0)
+    {
+        struct size_class *c = &classes[class];
+        if(list_empty(&c->free))
+        {
+            int n = depot_get(&depots[class], &c->free);
+            c->stats.free += n;
+            c->stats.from_depot += n;
+        }
+        if(!list_empty(&c->free))
+        {
+            i = list_first(struct buffer_const, &c->free, list);
+            list_del(&i->list);
+            c->stats.hits++;
+            c->stats.free--;
+            goto found;
+        }
+        c->stats.misses++;
+        buffer_size = BUFFER_CLASS_SIZE(class);
+        if(c->gc_credit >= buffer_size)
+        {
+            /* the gc freed one of these too eagerly */
+            c->gc_credit -= buffer_size;
+            c->stats.reallocated += buffer_size;
+        }
+    }
+    else
+    {
+        /* too big to pool, round up to nearest 4KiB */
+        buffer_size = ((min_size-1) & (~0xFFF)) + 0x1000;
+    }
+
+    i = buffer_alloc(buffer_size, class);
+    if(i == NULL)
+        return NULL;
+
+found:
+    if(class >= 0)
+    {
+        struct size_class *c = &classes[class];
+        if(++c->outstanding > c->peak)
+            c->peak = c->outstanding;
+    }
+    __sync_fetch_and_add(&in_use[USAGE_SLOT(class)], i->const_size);
+    i->ref_count = 1;
+    buffer *b = &i->b;
+    b->ptr = i->const_ptr;
+    b->size = i->const_size;
     b->list.next = b->list.prev = NULL;
 
     b->pos = 0;
@@ -70,6 +465,75 @@ buffer *buffer_get(size_t min_size)
     return b;
 }
 
+int buffer_pool_warm(size_t size, int count)
+{
+    init_pools();
+    int class = size_class(size);
+    if(class < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct size_class *c = &classes[class];
+    int n;
+    for(n = 0;n < count;n++)
+    {
+        struct buffer_const *i = buffer_alloc(BUFFER_CLASS_SIZE(class), class);
+        if(i == NULL)
+        {
+            errno = ENOMEM;
+            return n;
+        }
+        i->ref_count = 0;
+        i->last_used = time(NULL);
+        list_add_tail(&i->list, &c->free);
+        c->stats.free++;
+        c->reserve++;
+    }
+    return n;
+}
+
+void buffer_get_stats(struct buffer_class_stats *stats)
+{
+    init_pools();
+    int i;
+    for(i = 0;i < BUFFER_CLASS_COUNT;i++)
+    {
+        stats[i] = classes[i].stats;
+        stats[i].in_use = __atomic_load_n(&in_use[i], __ATOMIC_RELAXED);
+    }
+}
+
+void buffer_set_limit(size_t high, size_t low)
+{
+    limit_low = low < high ? low : high;
+    limit_high = high;
+    pressure = 0;
+}
+
+size_t buffer_in_use(void)
+{
+    size_t total = 0;
+    int i;
+    for(i = 0;i <= BUFFER_CLASS_COUNT;i++)
+        total += __atomic_load_n(&in_use[i], __ATOMIC_RELAXED);
+    return total;
+}
+
+int buffer_memory_pressure(void)
+{
+    if(limit_high == 0)
+        return 0;
+    /* once over the high watermark, stay under pressure until usage
+     * has fallen back to the low one */
+    size_t total = buffer_in_use();
+    if(total >= limit_high)
+        pressure = 1;
+    else if(total <= limit_low)
+        pressure = 0;
+    return pressure;
+}
+
 buffer *buffer_wrap(void *p, size_t len)
 {
     struct buffer_const *i = (struct buffer_const*)malloc(
@@ -78,6 +542,8 @@ buffer *buffer_wrap(void *p, size_t len)
     i->const_ptr  = b->ptr  = p;
     i->const_size = b->size = len;
     i->free_buf = 1;
+    i->in_arena = 0;
+    i->size_class = -1;
     i->ref_count = 1;
     i->list.next = i->list.prev = NULL;
     b->list.next = b->list.prev = NULL;
@@ -85,18 +551,67 @@ buffer *buffer_wrap(void *p, size_t len)
     b->used = b->size;
     b->orig = i;
 
+    __sync_fetch_and_add(&in_use[BUFFER_CLASS_COUNT], len);
     return b;
 }
 
 buffer *buffer_dup(buffer *b)
 {
     buffer *dup = get_meta();
+    if(dup == NULL)
+        return NULL;
     memcpy(dup, b, sizeof(buffer));
-    b->orig->ref_count++;
+    /* duplicates may be recycled on other threads */
+    __sync_fetch_and_add(&b->orig->ref_count, 1);
     dup->list.next = dup->list.prev = NULL;
     return dup;
 }
 
+buffer *buffer_slice(buffer *b, size_t offset, size_t len)
+{
+    if(offset > b->used || len > b->used - offset)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    buffer *slice = buffer_dup(b);
+    if(slice == NULL)
+        return NULL;
+    slice->ptr = (void*)((uintptr_t)b->ptr + offset);
+    slice->pos = 0;
+    slice->size = len;
+    slice->used = len;
+    return slice;
+}
+
+buffer *buffer_make_writable(buffer *b)
+{
+    if(__atomic_load_n(&b->orig->ref_count, __ATOMIC_ACQUIRE) == 1)
+        return b;
+
+    /* somebody else can see this data, so write to a private copy */
+    buffer *copy = buffer_get(b->size);
+    if(copy == NULL)
+        return NULL;
+    memcpy(copy->ptr, b->ptr, b->used);
+    copy->used = b->used;
+    copy->pos = b->pos;
+    buffer_recycle(b);
+    return copy;
+}
+
+static void buffer_free(struct buffer_const *b)
+{
+    if(b->in_arena)
+    {
+        arena_release(b);
+        return;
+    }
+    if(b->free_buf)
+        free(b->const_ptr);
+    free(b);
+}
+
 void buffer_recycle(buffer *buf)
 {
     ASSERT(buf->list.next == NULL && buf->list.prev == NULL);
@@ -105,46 +620,108 @@ void buffer_recycle(buffer *buf)
     buf->pos = 0;
     buf->size = b->const_size;
     buf->used = 0;
-    if(--buf->orig->ref_count == 0)
+    init_pools();
+    if(buf != &b->b)
+        put_meta(buf);
+
+    if(__sync_sub_and_fetch(&b->ref_count, 1) != 0)
+        return;
+    __sync_fetch_and_sub(&in_use[USAGE_SLOT(b->size_class)], b->const_size);
+    if(b->size_class < 0)
     {
-        b->last_used = time(NULL);
-        list_add_tail(&buf->orig->list, &free_buffers);
+        /* wrapped or oversized buffers aren't pooled */
+        buffer_free(b);
+        return;
     }
-    if(buf != &buf->orig->b)
+
+    int class = b->size_class;
+    struct size_class *c = &classes[class];
+    c->outstanding--;
+    b->last_used = time(NULL);
+    list_add(&b->list, &c->free);
+    int mag = magazine_size(class);
+    if(++c->stats.free >= 2 * mag)
     {
-        list_add(&buf->list, &avail_meta);
+        int n = depot_put(&depots[class], &c->free, mag);
+        c->stats.free -= n;
+        c->stats.to_depot += n;
     }
 }
 
-static void buffer_free(struct buffer_const *b)
+/* frees up to 'limit' (-1 for no limit) magazines in 'd' whose newest
+ * buffer is older than 'age', or regardless of age if 'age' is 0 */
+static size_t depot_collect(struct depot *d, time_t current_time, int age,
+        int meta, int limit)
 {
-    list_del(&b->list);
+    struct list_head old;
+    INIT_LIST_HEAD(&old);
+    size_t count = 0;
 
-    if(b->free_buf)
-        free(b->const_ptr);
-    free(b);
+    lock_depot(d);
+    /* the oldest magazines are at the tail */
+    while(!list_empty(&d->full) && limit--)
+    {
+        struct magazine *m = list_entry(d->full.prev, struct magazine, list);
+        if(age)
+        {
+            if(meta)
+                break;
+            struct buffer_const *newest =
+                list_first(struct buffer_const, &m->items, list);
+            if(current_time - newest->last_used <= age)
+                break;
+        }
+        list_move(&m->list, &old);
+        __atomic_store_n(&d->count, d->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    struct magazine *m, *n;
+    list_for_each_entry_safe(m, n, &old, list)
+    {
+        struct list_head *l, *next;
+        for(l = m->items.next;l != &m->items;l = next)
+        {
+            next = l->next;
+            if(meta)
+                free(list_entry(l, buffer, list));
+            else
+            {
+                struct buffer_const *i =
+                    list_entry(l, struct buffer_const, list);
+                count += i->const_size;
+                buffer_free(i);
+            }
+        }
+        free(m);
+    }
+    return count;
 }
 
 void buffer_garbage_collect(int age)
 {
     time_t current_time = time(NULL);
+    init_pools();
 
-#ifdef __DEBUG__
     size_t count = 0;
-#endif
 
-    struct buffer_const *i, *j;
-    list_for_each_entry_safe(i, j, &free_buffers, list)
+    int c;
+    for(c = 0;c < BUFFER_CLASS_COUNT;c++)
     {
-        if(!age || current_time - i->last_used > age)
+        /* oldest are at the tail */
+        struct list_head *l, *prev;
+        for(l = classes[c].free.prev;l != &classes[c].free;l = prev)
         {
-#ifdef __DEBUG__
+            prev = l->prev;
+            struct buffer_const *i = list_entry(l, struct buffer_const, list);
+            if(age && current_time - i->last_used <= age)
+                break;
             count += i->const_size;
-#endif
+            list_del(&i->list);
+            classes[c].stats.free--;
             buffer_free(i);
         }
-        else if(age)
-            break;
+        count += depot_collect(&depots[c], current_time, age, 0, -1);
     }
     if(!age)
     {
@@ -154,9 +731,68 @@ void buffer_garbage_collect(int age)
             list_del(&i->list);
             free(i);
         }
+        avail_meta_count = 0;
+        depot_collect(&meta_depot, current_time, 0, 1, -1);
+        free(spare);
+        spare = NULL;
     }
-#ifdef __DEBUG__
     if(count > 0)
         DPRINTF("Garbage collected %luKiB\n", count >> 10);
-#endif
+}
+
+size_t buffer_gc_step(size_t budget)
+{
+    init_pools();
+    size_t freed = 0;
+
+    /* largest first, they give the most back per free() */
+    int c;
+    for(c = BUFFER_CLASS_COUNT - 1;c >= 0;c--)
+    {
+        struct size_class *sc = &classes[c];
+        long outstanding = sc->outstanding > 0 ? sc->outstanding : 0;
+        if((sc->peak << 4) >= sc->demand)
+            sc->demand = sc->peak << 4;
+        else
+            sc->demand -= (sc->demand - (sc->peak << 4)) >> DEMAND_SHIFT;
+        sc->peak = outstanding;
+
+        /* keep enough free buffers to get back up to recent peak demand */
+        long target = (sc->demand + 15) >> 4;
+        if(target < sc->reserve)
+            target = sc->reserve;
+        target -= outstanding;
+        sc->stats.target = target > 0 ? target : 0;
+
+        size_t size = BUFFER_CLASS_SIZE(c);
+        while(sc->stats.free > sc->stats.target && freed < budget)
+        {
+            struct buffer_const *i =
+                list_entry(sc->free.prev, struct buffer_const, list);
+            list_del(&i->list);
+            sc->stats.free--;
+            buffer_free(i);
+            freed += size;
+            sc->stats.freed += size;
+            sc->gc_credit += size;
+        }
+        /* this thread has more than it needs, so anything parked in the
+         * depot is surplus as well */
+        if(sc->stats.free >= sc->stats.target && freed < budget)
+        {
+            size_t count = depot_collect(&depots[c], 0, 0, 0, 1);
+            freed += count;
+            sc->stats.freed += count;
+        }
+    }
+
+    /* glibc hands big blocks back by itself, but everything else stays
+     * in the heap until it's trimmed */
+    untrimmed += freed;
+    if(untrimmed >= TRIM_THRESHOLD)
+    {
+        malloc_trim(0);
+        untrimmed = 0;
+    }
+    return freed;
 }
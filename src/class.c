@@ -1,5 +1,9 @@
 
+#include <pthread.h>
+#include <string.h>
+
 #include "class.h"
+#include "list.h"
 
 #define CLASS_NAME(a,b) a##Object##b
 static Object METHOD_IMPL(construct)
@@ -10,16 +14,331 @@ static Object METHOD_IMPL(construct)
 static void METHOD_IMPL(deconstruct){}
 
 Object_t __Object;
+Object_vtable_t __Object_vtable;
 
-void __init_class_Object()
+__attribute__((constructor)) void __init_class_Object()
 {
-    static int initted = 0;
-    if(initted)
+    static volatile int initted = 0;
+    if(initted == 2)
+        return;
+    if(!__sync_bool_compare_and_swap(&initted, 0, 1))
+    {
+        while(initted != 2);
         return;
-    initted = 1;
-    Object this = &__Object;
-    this->__super__ = NULL;
+    }
+    Object_vtable_t *__vtable__ = &__Object_vtable;
+    __vtable__->__super__ = NULL;
+    __vtable__->__pool__ = NULL;
     VMETHOD(construct);
     VMETHOD(deconstruct);
+    __Object.__vtable__ = __vtable__;
+    __sync_synchronize();
+    initted = 2;
 }
 #undef CLASS_NAME
+
+/* == object pools == */
+
+/* most classes that can have a pool */
+#define CLASS_POOL_MAX          32
+/* objects a thread keeps of one class before giving half back */
+#define CLASS_POOL_THREAD_CACHE 64
+/* objects a thread takes from the shared list at once */
+#define CLASS_POOL_BATCH        16
+
+/* free objects are chained through their first word */
+#define NEXT(obj) (*(void**)(obj))
+
+struct class_pool
+{
+    int id;
+    size_t size;
+    int flags;
+
+    pthread_mutex_t lock;
+    void *free;
+    unsigned long free_count;
+
+    /* everything the pool has ever malloc'd, 'cached' is what isn't
+     * live */
+    unsigned long objects;
+    /* instances NEW'd and not yet DELETEd, and the most there have been
+     * at once. Threads with a thread local pool add to 'live' a batch at
+     * a time, so 'peak' can miss less than a batch per thread */
+    long live;
+    long peak;
+};
+
+static struct class_pool pools[CLASS_POOL_MAX];
+static int pool_count = 0;
+
+struct pool_cache
+{
+    void *head;
+    unsigned int count;
+    /* NEWs less DELETEs on this thread not yet added to the pool's
+     * count, which can go negative when objects are DELETEd on another
+     * thread than they were NEW'd on */
+    long live;
+};
+
+struct thread_caches
+{
+    struct list_head list;
+    struct pool_cache pools[CLASS_POOL_MAX];
+};
+
+static __thread struct thread_caches thread_caches;
+static __thread char thread_registered = 0;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+/* every thread that has used a thread local pool, for the stats */
+static LIST_HEAD(threads);
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* puts a chain of 'count' objects on the shared list */
+static void put_shared(struct class_pool *pool, void *head, void *tail,
+        unsigned long count)
+{
+    pthread_mutex_lock(&pool->lock);
+    NEXT(tail) = pool->free;
+    pool->free = head;
+    pool->free_count += count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* adds to the pool's live count, and its peak with it */
+static void count_live(struct class_pool *pool, long delta)
+{
+    long live = __atomic_add_fetch(&pool->live, delta, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+    while(live > peak && !__atomic_compare_exchange_n(&pool->peak, &peak,
+                live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* what a thread local pool's live count is with what threads haven't
+ * added yet, with threads_lock held */
+static long thread_totals(struct class_pool *pool)
+{
+    struct thread_caches *thread;
+    long live = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+    list_for_each_entry(thread, &threads, list)
+        live += __atomic_load_n(&thread->pools[pool->id].live,
+            __ATOMIC_RELAXED);
+    return live;
+}
+
+/* a thread's objects and counts outlive it in the pools */
+static void thread_exit(void *arg)
+{
+    struct thread_caches *thread = (struct thread_caches*)arg;
+    int i;
+    pthread_mutex_lock(&threads_lock);
+    for(i = 0;i < pool_count && i < CLASS_POOL_MAX;i++)
+    {
+        struct class_pool *pool = &pools[i];
+        struct pool_cache *cache = &thread->pools[i];
+        if(!(pool->flags & CLASS_POOL_THREAD_LOCAL))
+            continue;
+        count_live(pool, cache->live);
+        cache->live = 0;
+        if(!cache->head)
+            continue;
+        void *tail = cache->head;
+        while(NEXT(tail))
+            tail = NEXT(tail);
+        put_shared(pool, cache->head, tail, cache->count);
+        cache->head = NULL;
+        cache->count = 0;
+    }
+    list_del(&thread->list);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static void make_thread_key(void)
+{
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+static struct pool_cache *thread_cache(struct class_pool *pool)
+{
+    if(__builtin_expect(!thread_registered, 0))
+    {
+        pthread_once(&thread_key_once, make_thread_key);
+        pthread_setspecific(thread_key, &thread_caches);
+        pthread_mutex_lock(&threads_lock);
+        list_add(&thread_caches.list, &threads);
+        pthread_mutex_unlock(&threads_lock);
+        thread_registered = 1;
+    }
+    return &thread_caches.pools[pool->id];
+}
+
+static void *pool_get(struct class_pool *pool)
+{
+    struct pool_cache *cache = NULL;
+    void *obj;
+    if(pool->flags & CLASS_POOL_THREAD_LOCAL)
+    {
+        cache = thread_cache(pool);
+        if(!cache->head &&
+                __atomic_load_n(&pool->free_count, __ATOMIC_RELAXED))
+        {
+            /* take a batch, so the lock isn't taken for every object */
+            pthread_mutex_lock(&pool->lock);
+            while(pool->free && cache->count < CLASS_POOL_BATCH)
+            {
+                obj = pool->free;
+                pool->free = NEXT(obj);
+                pool->free_count--;
+                NEXT(obj) = cache->head;
+                cache->head = obj;
+                cache->count++;
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+        obj = cache->head;
+        if(obj)
+        {
+            cache->head = NEXT(obj);
+            cache->count--;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->lock);
+        obj = pool->free;
+        if(obj)
+        {
+            pool->free = NEXT(obj);
+            pool->free_count--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if(!obj)
+    {
+        /* NEW fails as it would have with malloc */
+        if(!(obj = malloc(pool->size)))
+            return NULL;
+        __atomic_add_fetch(&pool->objects, 1, __ATOMIC_RELAXED);
+    }
+
+    if(cache)
+    {
+        /* only read by the stats, so plain stores do. The pool's count
+         * is shared, so it's added to a batch at a time */
+        long live = cache->live + 1;
+        if(live == CLASS_POOL_BATCH)
+        {
+            count_live(pool, live);
+            live = 0;
+        }
+        __atomic_store_n(&cache->live, live, __ATOMIC_RELAXED);
+        return obj;
+    }
+    count_live(pool, 1);
+    return obj;
+}
+
+static void pool_put(struct class_pool *pool, void *obj)
+{
+    if(!(pool->flags & CLASS_POOL_THREAD_LOCAL))
+    {
+        __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+        put_shared(pool, obj, obj, 1);
+        return;
+    }
+
+    struct pool_cache *cache = thread_cache(pool);
+    long live = cache->live - 1;
+    if(live == -CLASS_POOL_BATCH)
+    {
+        count_live(pool, live);
+        live = 0;
+    }
+    __atomic_store_n(&cache->live, live, __ATOMIC_RELAXED);
+    NEXT(obj) = cache->head;
+    cache->head = obj;
+    if(++cache->count <= CLASS_POOL_THREAD_CACHE)
+        return;
+    /* a thread that frees more than it allocates passes them on */
+    void *head = cache->head, *tail = head;
+    unsigned int count = cache->count / 2, i;
+    for(i = 1;i < count;i++)
+        tail = NEXT(tail);
+    cache->head = NEXT(tail);
+    cache->count -= count;
+    put_shared(pool, head, tail, count);
+}
+
+void *__class_alloc(Object_vtable_t *vtable, void *identity, size_t size)
+{
+    struct class_pool *pool = vtable->__pool__;
+    if(!pool)
+        return memdup(identity, size);
+
+    void *obj = pool_get(pool);
+    if(!obj)
+        return NULL;
+    memcpy(obj, identity, size);
+    return obj;
+}
+
+void __class_free(Object obj)
+{
+    struct class_pool *pool = obj->__vtable__->__pool__;
+    if(!pool)
+    {
+        free(obj);
+        return;
+    }
+    pool_put(pool, obj);
+}
+
+void __class_pool_init(Object_vtable_t *vtable, size_t size,
+        size_t prealloc, int flags)
+{
+    int id = __sync_fetch_and_add(&pool_count, 1);
+    /* out of pools, the class carries on with malloc */
+    if(id >= CLASS_POOL_MAX)
+        return;
+    struct class_pool *pool = &pools[id];
+    pool->id = id;
+    pool->size = size;
+    pool->flags = flags;
+    pthread_mutex_init(&pool->lock, NULL);
+    while(prealloc--)
+    {
+        void *obj = malloc(size);
+        if(!obj)
+            break;
+        NEXT(obj) = pool->free;
+        pool->free = obj;
+        pool->free_count++;
+        pool->objects++;
+    }
+    vtable->__pool__ = pool;
+}
+
+void __class_pool_stats(Object_vtable_t *vtable, struct class_pool_stats *stats)
+{
+    struct class_pool *pool = vtable->__pool__;
+    memset(stats, 0, sizeof(*stats));
+    if(!pool)
+        return;
+    long live = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+    if(pool->flags & CLASS_POOL_THREAD_LOCAL)
+    {
+        pthread_mutex_lock(&threads_lock);
+        live = thread_totals(pool);
+        pthread_mutex_unlock(&threads_lock);
+        if(live > peak)
+            peak = live;
+    }
+    stats->size = pool->size;
+    stats->live = live;
+    stats->peak = peak;
+    stats->cached = __atomic_load_n(&pool->objects, __ATOMIC_RELAXED) - live;
+}
@@ -0,0 +1,110 @@
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include "eventbackend.h"
+#include "debug.h"
+
+static int epoll_init(eventloop loop)
+{
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->fd == -1)
+    {
+        return EVENTMGR_EPOLL_CREATE_FAILED;
+    }
+    return EVENTMGR_SUCCESS;
+}
+
+static void epoll_cleanup(eventloop loop)
+{
+    close(loop->fd);
+}
+
+static int epoll_ctl_event(eventloop loop, event e, int op)
+{
+    struct epoll_event epoll_event;
+    epoll_event.events = EPOLLET;
+    if(e->info.events & EV_READ)
+        epoll_event.events |= EPOLLIN;
+    if(e->info.events & EV_WRITE)
+        epoll_event.events |= EPOLLOUT;
+    if(e->info.events & EV_EXCEPT)
+        epoll_event.events |= EPOLLERR;
+    epoll_event.data.ptr = e;
+    e->backend_events = e->info.events;
+    return epoll_ctl(loop->fd, op, e->info.fd, &epoll_event);
+}
+
+static int epoll_add(eventloop loop, event e)
+{
+    if(epoll_ctl_event(loop, e, EPOLL_CTL_ADD) == -1)
+    {
+        return EVENTMGR_EPOLL_ADD_FAILED;
+    }
+    return EVENTMGR_SUCCESS;
+}
+
+static int epoll_modify(eventloop loop, event e)
+{
+    if(epoll_ctl_event(loop, e, EPOLL_CTL_MOD) == -1)
+    {
+        return EVENTMGR_EPOLL_MOD_FAILED;
+    }
+    return EVENTMGR_SUCCESS;
+}
+
+static int epoll_remove(eventloop loop, event e)
+{
+    if(epoll_ctl(loop->fd, EPOLL_CTL_DEL, e->info.fd, NULL) == -1)
+    {
+        return EVENTMGR_EPOLL_DEL_FAILED;
+    }
+    return EVENTMGR_SUCCESS;
+}
+
+static int epoll_wait_events(eventloop loop, int milliseconds)
+{
+    struct epoll_event events[32];
+    int ready_count = epoll_wait(
+            loop->fd,
+            events,
+            32,
+            milliseconds);
+
+    if(ready_count == -1)
+    {
+        /* a signal isn't a failure, the caller will just tick again */
+        if(errno == EINTR)
+            return EVENTMGR_SUCCESS;
+        return EVENTMGR_EPOLL_WAIT_FAILED;
+    }
+    int i;
+    for(i = 0;i < ready_count;i++)
+    {
+        struct event *e = (struct event*)events[i].data.ptr;
+
+        int event_flags = events[i].events;
+        int ready = 0;
+        if(event_flags & EPOLLIN)
+            ready |= EV_READ;
+        if(event_flags & EPOLLOUT)
+            ready |= EV_WRITE;
+        if(event_flags & EPOLLERR)
+            ready |= EV_EXCEPT;
+        eventmanager_ready(e, ready);
+    }
+    return EVENTMGR_SUCCESS;
+}
+
+const struct event_backend epoll_backend =
+{
+    .name = "epoll",
+    .init = epoll_init,
+    .cleanup = epoll_cleanup,
+    .add = epoll_add,
+    .modify = epoll_modify,
+    .remove = epoll_remove,
+    .wait = epoll_wait_events,
+};
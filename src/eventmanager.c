@@ -1,34 +1,17 @@
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
-#include <sys/epoll.h>
-
-#include "heap.h"
+#include "timerwheel.h"
 #include "eventmanager.h"
+#include "eventbackend.h"
 #include "debug.h"
 
-struct event
-{
-    struct list_head list;
-    struct list_head pending_removal;
-    struct list_head pending_read;
-    struct list_head pending_write;
-    struct event_info info;
-    struct tree_node alarm_tree;
-};
-
-static LIST_HEAD(events);
-
-static LIST_HEAD(pending_read);
-static LIST_HEAD(pending_write);
-static LIST_HEAD(pending_removal);
-
-static int epoll_fd = -1;
-
-static Heap alarm_heap = NULL;
-
 const char *error_strings[] =
 {
     "Success",
@@ -38,7 +21,11 @@ const char *error_strings[] =
     "EPOLL Del call failed",
     "EPOLL Wait call failed",
     "Eventmanager is not initialized",
-    "Error involving RTC (/dev/rtc)",
+    "Failed to start event loop thread",
+    "io_uring setup failed",
+    "io_uring enter call failed",
+    "Out of memory",
+    "Not supported by the backend",
 };
 
 const char *eventmanager_strerror(int err)
@@ -48,80 +35,123 @@ const char *eventmanager_strerror(int err)
     return error_strings[err];
 }
 
-int eventmanager_init(void)
+static inline long long now_ms(void)
 {
-    epoll_fd = epoll_create1(0);
-    if(epoll_fd == -1)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int eventmanager_init(eventloop *out, int backend)
+{
+    eventloop loop = (eventloop)malloc(sizeof(struct eventloop));
+    if(loop == NULL)
+        return EVENTMGR_NO_MEMORY;
+    memset(loop, '\0', sizeof(*loop));
+
+    int result = EVENTMGR_URING_SETUP_FAILED;
+    if(backend == EVENTMGR_BACKEND_IO_URING)
     {
-        return EVENTMGR_EPOLL_CREATE_FAILED;
+        loop->backend = &uring_backend;
+        result = loop->backend->init(loop);
+        if(result != EVENTMGR_SUCCESS)
+            DPRINTF("io_uring unavailable (%s), falling back to epoll\n",
+                eventmanager_strerror(result));
     }
-
-    long long compare(long long a, long long b)
+    if(result != EVENTMGR_SUCCESS)
     {
-        return a < b?-1:1;
+        loop->backend = &epoll_backend;
+        result = loop->backend->init(loop);
     }
-    alarm_heap = NEW(Heap, &compare);
+    if(result != EVENTMGR_SUCCESS)
+    {
+        free(loop);
+        return result;
+    }
+    slab_cache_init(&loop->events, sizeof(struct event));
+    slab_cache_init(&loop->timers, sizeof(struct event_timer));
+    INIT_LIST_HEAD(&loop->pending_read);
+    INIT_LIST_HEAD(&loop->pending_write);
+    INIT_LIST_HEAD(&loop->pending_removal);
+
+    loop->alarms = NEW(TimerWheel, now_ms());
+    *out = loop;
     return EVENTMGR_SUCCESS;
 }
 
-static inline char check_initialized(void)
+const char *eventmanager_backend_name(eventloop loop)
+{
+    return loop->backend->name;
+}
+
+int eventmanager_submits_io(eventloop loop)
 {
-    return epoll_fd != -1;
+    return loop->submits_io;
 }
 
-int event_register(struct event_info *event_info, struct event **event)
+static inline char check_initialized(eventloop loop)
 {
-    if(!check_initialized())
+    return loop != NULL && loop->fd != -1;
+}
+
+int event_register(eventloop loop, struct event_info *event_info,
+        struct event **event)
+{
+    if(!check_initialized(loop))
         return EVENTMGR_NOT_INITIALIZED;
+    if(event_info->events & EV_SUBMIT && !loop->submits_io)
+        return EVENTMGR_NOT_SUPPORTED;
 
-    struct event *e = (struct event*)malloc(sizeof(struct event));
+    struct event *e = (struct event*)slab_alloc(&loop->events);
+    if(e == NULL)
+        return EVENTMGR_NO_MEMORY;
     memset(e, '\0', sizeof(*e));
     e->info = *event_info;
+    e->loop = loop;
     INIT_LIST_HEAD(&e->pending_read);
     INIT_LIST_HEAD(&e->pending_write);
     INIT_LIST_HEAD(&e->pending_removal);
 
     if(event_info->fd != -1)
     {
-        struct epoll_event epoll_event;
-        epoll_event.events = EPOLLET;
-        if(event_info->events & EV_READ)
-            epoll_event.events |= EPOLLIN;
-        if(event_info->events & EV_WRITE)
-            epoll_event.events |= EPOLLOUT;
-        if(event_info->events & EV_EXCEPT)
-            epoll_event.events |= EPOLLERR;
-        epoll_event.data.ptr = e;
-        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_info->fd, &epoll_event) == -1)
+        int result = loop->backend->add(loop, e);
+        if(result != EVENTMGR_SUCCESS)
         {
-            free(e);
-            return EVENTMGR_EPOLL_ADD_FAILED;
+            slab_free(e);
+            return result;
         }
     }
     *event = e;
-    list_add(&e->list, &events);
 
     return EVENTMGR_SUCCESS;
 }
 
+static void event_alarm_fired(event_timer timer, void *context);
+
 int event_alarm(struct event *event, int milliseconds)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-
-    long long ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-    ms += milliseconds;
-    if(event->alarm_tree.ctxt != NULL)
+    /* it would only go off after the event was freed */
+    if(event->removed)
+        return EVENTMGR_SUCCESS;
+    if(!event->alarm)
     {
-        CALL((Heap)event->alarm_tree.ctxt, remove, &event->alarm_tree);
+        int result = event_timer_register(event->loop, event_alarm_fired,
+            event, &event->alarm);
+        if(result != EVENTMGR_SUCCESS)
+            return result;
     }
-    CALL(alarm_heap, put, &event->alarm_tree, ms);
-    return 0;
+    return event_timer_arm(event->alarm, milliseconds);
+}
+
+eventloop event_get_loop(struct event *event)
+{
+    return event->loop;
 }
 
 int event_modify(struct event *event, int events)
 {
-    if(!check_initialized())
+    eventloop loop = event->loop;
+    if(!check_initialized(loop))
         return EVENTMGR_NOT_INITIALIZED;
 
     struct event_info *event_info = &event->info;
@@ -137,68 +167,111 @@ int event_modify(struct event *event, int events)
             event_info->events &= ~events;
         else if(action == EV_SET)
             event_info->events = events;
+        /* who does the io is settled when registering */
+        event_info->events = (event_info->events & ~EV_SUBMIT) |
+            (orig_events & EV_SUBMIT);
 
         /* guarantee 'write' gets called initially
          * (epoll documentation is unclear on this) */
         if(event_info->events & EV_WRITE && list_empty(&event->pending_write))
-            list_add_tail(&event->pending_write, &pending_write);
+            list_add_tail(&event->pending_write, &loop->pending_write);
 
         /* if there's no change, don't waste a syscall */
         if(orig_events == event_info->events)
             return EVENTMGR_SUCCESS;
 
-        struct epoll_event epoll_event;
-        epoll_event.events = EPOLLET;
-        if(event_info->events & EV_READ)
-            epoll_event.events |= EPOLLIN;
-        if(event_info->events & EV_WRITE)
-            epoll_event.events |= EPOLLOUT;
-        if(event_info->events & EV_EXCEPT)
-            epoll_event.events |= EPOLLERR;
-        epoll_event.data.ptr = event;
-        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, event_info->fd, &epoll_event) == -1)
-        {
-            return EVENTMGR_EPOLL_MOD_FAILED;
-        }
+        return loop->backend->modify(loop, event);
     }
     return EVENTMGR_SUCCESS;
 }
 
 int event_deregister(struct event *event)
 {
-    if(!check_initialized())
+    eventloop loop = event->loop;
+    if(!check_initialized(loop))
         return EVENTMGR_NOT_INITIALIZED;
 
-    if(list_empty(&event->pending_removal))
-        list_add_tail(&event->pending_removal, &pending_removal);
-    if(event->alarm_tree.ctxt != NULL)
-        CALL((Heap)event->alarm_tree.ctxt, remove, &event->alarm_tree);
-    if(event->info.fd != -1)
+    if(!event->removed)
     {
-        if(!epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event->info.fd, NULL) == -1)
-        {
-            return EVENTMGR_EPOLL_DEL_FAILED;
-        }
+        event->removed = 1;
+        list_add_tail(&event->pending_removal, &loop->pending_removal);
     }
+    if(event->alarm)
+    {
+        event_timer_deregister(event->alarm);
+        event->alarm = NULL;
+    }
+    if(event->info.fd != -1)
+        return loop->backend->remove(loop, event);
+    return EVENTMGR_SUCCESS;
+}
+
+int event_send(struct event *event, struct event_send *send)
+{
+    eventloop loop = event->loop;
+    if(!check_initialized(loop))
+        return EVENTMGR_NOT_INITIALIZED;
+    if(!(event->info.events & EV_SUBMIT))
+        return EVENTMGR_NOT_SUPPORTED;
+    send->event = event;
+    return loop->backend->send(loop, send);
+}
+
+int event_timer_register(eventloop loop,
+        void (*callback)(event_timer timer, void *context), void *context,
+        event_timer *timer)
+{
+    if(!check_initialized(loop))
+        return EVENTMGR_NOT_INITIALIZED;
+
+    event_timer t = (event_timer)slab_alloc(&loop->timers);
+    if(t == NULL)
+        return EVENTMGR_NO_MEMORY;
+    memset(&t->node, '\0', sizeof(t->node));
+    t->loop = loop;
+    t->callback = callback;
+    t->context = context;
+    *timer = t;
+    return EVENTMGR_SUCCESS;
+}
+
+int event_timer_arm(event_timer timer, int milliseconds)
+{
+    CALL(timer->loop->alarms, arm, &timer->node, now_ms() + milliseconds);
+    return EVENTMGR_SUCCESS;
+}
+
+void event_timer_cancel(event_timer timer)
+{
+    CALL(timer->loop->alarms, cancel, &timer->node);
+}
+
+int event_timer_deregister(event_timer timer)
+{
+    /* the wheel forgets a timer before calling it, so nothing else can
+     * be holding on to it */
+    CALL(timer->loop->alarms, cancel, &timer->node);
+    slab_free(timer);
     return EVENTMGR_SUCCESS;
 }
 
 static int trigger_event(event e, int (*callback)(event e, struct event_info*))
 {
+    eventloop loop = e->loop;
     if(!callback)
         return EV_DONE;
     int result = callback(e, &e->info);
     if((result & EV_READ_PENDING))
     {
         if(list_empty(&e->pending_read))
-            list_add(&e->pending_read, &pending_read);
+            list_add(&e->pending_read, &loop->pending_read);
     }
     else if(callback == e->info.read)
         list_del_init(&e->pending_read);
     if((result & EV_WRITE_PENDING))
     {
         if(list_empty(&e->pending_write))
-            list_add(&e->pending_write, &pending_write);
+            list_add(&e->pending_write, &loop->pending_write);
     }
     else if(callback == e->info.write)
         list_del_init(&e->pending_write);
@@ -206,29 +279,43 @@ static int trigger_event(event e, int (*callback)(event e, struct event_info*))
     return result;
 }
 
-int eventmanager_tick(int milliseconds)
+static void event_alarm_fired(event_timer timer, void *context)
+{
+    event e = (event)context;
+    trigger_event(e, e->info.alarm);
+}
+
+static void free_event(event e)
 {
-    if(!check_initialized())
+    list_del(&e->pending_removal);
+    list_del(&e->pending_read);
+    list_del(&e->pending_write);
+    slab_free(e);
+}
+
+int eventmanager_tick(eventloop loop, int milliseconds)
+{
+    if(!check_initialized(loop))
         return EVENTMGR_NOT_INITIALIZED;
 
     struct event *x, *y;
     int pending = 0;
-    list_for_each_entry_safe(x, y, &pending_removal, pending_removal)
+    list_for_each_entry_safe(x, y, &loop->pending_removal, pending_removal)
     {
-        list_del(&x->pending_removal);
-        list_del(&x->pending_read);
-        list_del(&x->pending_write);
-        list_del(&x->list);
-        free(x);
+        /* the backend may still have requests in flight for it */
+        if(x->inflight == 0)
+            free_event(x);
     }
-    list_for_each_entry_safe(x, y, &pending_read, pending_read)
+    /* deregistered events can outlive the tick while the backend has
+     * requests in flight for them, but are never called again */
+    list_for_each_entry_safe(x, y, &loop->pending_read, pending_read)
     {
-        if(x->info.events & EV_READ)
+        if(x->info.events & EV_READ && !x->removed)
             pending |= trigger_event(x, x->info.read);
     }
-    list_for_each_entry_safe(x, y, &pending_write, pending_write)
+    list_for_each_entry_safe(x, y, &loop->pending_write, pending_write)
     {
-        if(x->info.events & EV_WRITE)
+        if(x->info.events & EV_WRITE && !x->removed)
             pending |= trigger_event(x, x->info.write);
     }
 
@@ -236,87 +323,182 @@ int eventmanager_tick(int milliseconds)
     if(pending)
         milliseconds = 0;
 
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-    long long ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-    while(1)
+    long long ms = now_ms();
+    struct timer_node *alarm;
+    while((alarm = CALL(loop->alarms, expire, ms)))
     {
-        struct tree_node *alarm = CALL(alarm_heap, peek);
-        if(alarm)
-        {
-            struct event *e =
-                list_entry(alarm, struct event, alarm_tree);
-            if(ms >= alarm->priority)
-            {
-                DPRINTF("alarm triggered: %lldms (%lld)\n", 
-                    alarm->priority,
-                    ms - alarm->priority);
-                CALL(alarm_heap, remove, alarm);
-                trigger_event(e, e->info.alarm);
-            }
-            else
-            {
-                long long offs = alarm->priority - ms;
-                if(milliseconds > offs)
-                {
-                    milliseconds = (int)offs;
-                    DPRINTF("truncating sleep time to %dms\n", milliseconds);
-                }
-                break;
-            }
-        }
-        else
+        event_timer timer = list_entry(alarm, struct event_timer, node);
+        DPRINTF("alarm triggered: %lldms (%lld)\n",
+            alarm->expires,
+            ms - alarm->expires);
+        timer->callback(timer, timer->context);
+    }
+
+    long long next = CALL(loop->alarms, next_expiry);
+    if(next != -1)
+    {
+        long long offs = next - ms;
+        if(offs < 0)
+            offs = 0;
+        if(milliseconds > offs || milliseconds < 0)
         {
-            break;
+            milliseconds = (int)offs;
+            DPRINTF("truncating sleep time to %dms\n", milliseconds);
         }
     }
 
-    struct epoll_event events[32];
-    int ready_count = epoll_wait(
-            epoll_fd,
-            events,
-            32,
-            milliseconds);
+    return loop->backend->wait(loop, milliseconds);
+}
 
-    if(ready_count == -1)
+void eventmanager_ready(event e, int events)
+{
+    eventloop loop = e->loop;
+    /* stale readiness for something that's on its way out */
+    if(e->removed)
+        return;
+    if(events & EV_READ && list_empty(&e->pending_read))
+    {
+        list_add(&e->pending_read, &loop->pending_read);
+    }
+    if(events & EV_WRITE && list_empty(&e->pending_write))
     {
-        return EVENTMGR_EPOLL_WAIT_FAILED;
+        list_add(&e->pending_write, &loop->pending_write);
     }
-    int i;
-    for(i = 0;i < ready_count;i++)
+    if(events & EV_EXCEPT && e->info.except)
     {
-        struct event *e = (struct event*)events[i].data.ptr;
+        trigger_event(e, e->info.except);
+    }
+}
 
-        int event_flags = events[i].events;
-        if(event_flags & EPOLLIN && list_empty(&e->pending_read))
-        {
-            list_add(&e->pending_read, &pending_read);
-        }
-        if(event_flags & EPOLLOUT && list_empty(&e->pending_write))
-        {
-            list_add(&e->pending_write, &pending_write);
-        }
-        if(event_flags & EPOLLERR && e->info.except)
-        {
-            trigger_event(e, e->info.except);
-        }
+void eventmanager_received(event e, buffer *b, int result)
+{
+    if(e->removed)
+    {
+        if(b)
+            buffer_recycle(b);
+        return;
     }
-    return EVENTMGR_SUCCESS;
+    e->info.received(e, &e->info, b, result);
 }
 
-void eventmanager_cleanup()
+void eventmanager_accepted(event e, int fd)
 {
-    if(!check_initialized())
+    /* nobody is left to take it */
+    if(e->removed)
+    {
+        if(fd >= 0)
+            close(fd);
         return;
+    }
+    e->info.accepted(e, &e->info, fd);
+}
 
-    event i, j;
-    list_for_each_entry_safe(i, j, &pending_removal, pending_removal)
+void eventmanager_cleanup(eventloop loop)
+{
+    if(!check_initialized(loop))
+        return;
+
+    loop->backend->cleanup(loop);
+    loop->fd = -1;
+    DELETE(loop->alarms);
+    /* anything still registered belongs to this loop alone */
+    slab_cache_destroy(&loop->events);
+    slab_cache_destroy(&loop->timers);
+    free(loop);
+}
+
+struct loop_thread
+{
+    pthread_t thread;
+    int index;
+    int backend;
+    int result;
+    int (*setup)(eventloop loop, int index, void *context);
+    void (*teardown)(eventloop loop, int index, void *context);
+    void *context;
+    volatile int *quit;
+};
+
+static void *loop_thread_main(void *arg)
+{
+    struct loop_thread *t = (struct loop_thread*)arg;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus > 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->index % cpus, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            DPRINTF("unable to pin loop %d to cpu %ld\n",
+                t->index, t->index % cpus);
+    }
+
+    eventloop loop;
+    t->result = eventmanager_init(&loop, t->backend);
+    if(t->result != EVENTMGR_SUCCESS)
+        return NULL;
+
+    if(t->setup && t->setup(loop, t->index, t->context) != 0)
     {
-        list_del(&i->pending_removal);
-        list_del(&i->pending_read);
-        list_del(&i->pending_write);
-        list_del(&i->list);
-        free(i);
+        DPRINTF("setup failed for loop %d\n", t->index);
+        /* the rest stop too, rather than serve with a loop short */
+        t->result = EVENTMGR_THREAD_FAILED;
+        *t->quit = 1;
+        eventmanager_cleanup(loop);
+        return NULL;
+    }
+    while(!*t->quit)
+    {
+        t->result = eventmanager_tick(loop, 1000);
+        if(t->result != EVENTMGR_SUCCESS)
+            break;
     }
+    if(t->teardown)
+        t->teardown(loop, t->index, t->context);
+    eventmanager_cleanup(loop);
+    /* buffers the loop kept for receiving into went back to this
+     * thread's pool, which doesn't outlive the thread */
+    buffer_garbage_collect(0);
+    return NULL;
 }
 
+int eventmanager_run_threads(int count, int backend,
+        int (*setup)(eventloop loop, int index, void *context),
+        void (*teardown)(eventloop loop, int index, void *context),
+        void *context,
+        volatile int *quit)
+{
+    struct loop_thread *threads = (struct loop_thread*)calloc(
+        count, sizeof(struct loop_thread));
+    if(threads == NULL)
+        return EVENTMGR_THREAD_FAILED;
+
+    int i, result = EVENTMGR_SUCCESS;
+    for(i = 0;i < count;i++)
+    {
+        threads[i].index = i;
+        threads[i].backend = backend;
+        threads[i].setup = setup;
+        threads[i].teardown = teardown;
+        threads[i].context = context;
+        threads[i].quit = quit;
+        if(pthread_create(&threads[i].thread, NULL,
+                    loop_thread_main, &threads[i]) != 0)
+        {
+            DPRINTF("unable to start loop %d\n", i);
+            *quit = 1;
+            result = EVENTMGR_THREAD_FAILED;
+            break;
+        }
+    }
+    count = i;
+    for(i = 0;i < count;i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        if(result == EVENTMGR_SUCCESS)
+            result = threads[i].result;
+    }
+    free(threads);
+    return result;
+}
@@ -0,0 +1,113 @@
+
+#include <string.h>
+#include <strings.h>
+
+#include "http_headers.h"
+#include "debug.h"
+
+#ifdef __x86_64__
+#include <emmintrin.h>
+#define HTTP_HEADERS_SSE2
+#endif
+
+/* zero padded to HTTP_HEADER_NAME_MAX, so they can be compared a whole
+ * vector at a time */
+struct known_name
+{
+    char name[HTTP_HEADER_NAME_MAX] __attribute__((aligned(16)));
+    size_t len;
+};
+
+static const struct known_name known[HTTP_HEADER_COUNT] = {
+#define HTTP_HEADER_NAME(id, name, first, middle, last)                     \
+    [HTTP_HEADER_ ## id] = { name, sizeof(name) - 1 },
+    HTTP_HEADER_LIST(HTTP_HEADER_NAME)
+#undef HTTP_HEADER_NAME
+};
+
+/* the one known name a hash could be. Dense enough for the compiler to
+ * make it a table */
+static int lookup(unsigned int hash)
+{
+    switch(hash)
+    {
+#define HTTP_HEADER_CASE(id, name, first, middle, last)                     \
+    case HTTP_HEADER_HASH(sizeof(name) - 1, first, middle, last):           \
+        return HTTP_HEADER_ ## id;
+    HTTP_HEADER_LIST(HTTP_HEADER_CASE)
+#undef HTTP_HEADER_CASE
+    }
+    return HTTP_HEADER_OTHER;
+}
+
+#ifdef HTTP_HEADERS_SSE2
+/* A-Z to a-z, everything else left alone */
+static inline __m128i fold(__m128i c)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+        _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(c, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+int http_header_id(const char *name, size_t len)
+{
+    if(len == 0 || len > HTTP_HEADER_NAME_MAX)
+        return HTTP_HEADER_OTHER;
+
+    /* a padded copy, it's folded a vector at a time without reading
+     * past the name */
+    unsigned char folded[HTTP_HEADER_NAME_MAX] __attribute__((aligned(16)));
+    memset(folded, '\0', sizeof(folded));
+    memcpy(folded, name, len);
+#ifdef HTTP_HEADERS_SSE2
+    __m128i lo = fold(_mm_load_si128((const __m128i*)folded));
+    __m128i hi = fold(_mm_load_si128((const __m128i*)(folded + 16)));
+    _mm_store_si128((__m128i*)folded, lo);
+    _mm_store_si128((__m128i*)(folded + 16), hi);
+#else
+    size_t i;
+    for(i = 0;i < len;i++)
+    {
+        if(folded[i] >= 'A' && folded[i] <= 'Z')
+            folded[i] |= 0x20;
+    }
+#endif
+
+    int id = lookup(HTTP_HEADER_HASH(len, folded[0], folded[len / 2],
+        folded[len - 1]));
+    if(id == HTTP_HEADER_OTHER || known[id].len != len)
+        return HTTP_HEADER_OTHER;
+
+    /* the known names are written as usual, so they're folded too */
+#ifdef HTTP_HEADERS_SSE2
+    const __m128i *k = (const __m128i*)known[id].name;
+    __m128i eq = _mm_and_si128(
+        _mm_cmpeq_epi8(lo, fold(_mm_load_si128(k))),
+        _mm_cmpeq_epi8(hi, fold(_mm_load_si128(k + 1))));
+    if(_mm_movemask_epi8(eq) != 0xffff)
+        return HTTP_HEADER_OTHER;
+#else
+    if(strncasecmp(known[id].name, (const char*)folded, len) != 0)
+        return HTTP_HEADER_OTHER;
+#endif
+    return id;
+}
+
+const char *http_header_name(int id)
+{
+    if(id <= HTTP_HEADER_OTHER || id >= HTTP_HEADER_COUNT)
+        return NULL;
+    return known[id].name;
+}
+
+#ifdef __DEBUG__
+/* a wrong character in HTTP_HEADER_LIST doesn't break the build, it
+ * leaves that header never recognised */
+__attribute__((constructor)) static void http_headers_check(void)
+{
+    int id;
+    for(id = HTTP_HEADER_OTHER + 1;id < HTTP_HEADER_COUNT;id++)
+        ASSERT(http_header_id(known[id].name, known[id].len) == id);
+}
+#endif
@@ -2,10 +2,13 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 
 #include "debug.h"
 #include "class.h"
 #include "http_parser.h"
+#include "http_scan.h"
+#include "http_headers.h"
 #include "buffermanager.h"
 
 #define STATE_REQUEST       0
@@ -13,182 +16,587 @@
 #define STATE_HEADERS       2
 #define STATE_BODY          3
 #define STATE_EOF           4
+#define STATE_ERROR         5
 
-#define MAX_HEADERS         128
+/* where a chunked body is up to */
+#define CHUNK_SIZE          0
+#define CHUNK_EXT           1
+#define CHUNK_DATA          2
+#define CHUNK_DATA_CR       3
+#define CHUNK_DATA_LF       4
+#define CHUNK_TRAILER       5
+#define CHUNK_TRAILER_LINE  6
+#define CHUNK_TRAILER_LF    7
 
-struct search_state
-{
-    char needle[128];
-    int pos;
-};
+/* hex digits a chunk size may have, keeps it inside 64 bits */
+#define CHUNK_MAX_DIGITS    15
+
+/* smallest arena buffer to ask for */
+#define HTTP_ARENA_SIZE     1024
+
+#define HTTP_POOL_PREALLOC  256
 
 #define CLASS_NAME(a,b) a## Http ##b
 static Http METHOD_IMPL(construct)
 {
     SUPER_CALL(Object, this, construct);
-    this->buffer = (StringIO)NEW(MemStringIO);
-    this->msg.headers = (char***)malloc(128 * sizeof(char**));
+    INIT_LIST_HEAD(&this->pending);
     return this;
 }
 
+static void release(Http this)
+{
+    int i;
+    for(i = 0;i < this->msg.buffer_count;i++)
+        buffer_recycle(this->msg.buffers[i]);
+    this->msg.buffer_count = 0;
+}
+
 static void METHOD_IMPL(deconstruct)
 {
-    DELETE(this->buffer);
-    if(this->search)
-        free(this->search);
+    release(this);
+    while(!list_empty(&this->pending))
+    {
+        buffer *b = list_entry(this->pending.next, buffer, list);
+        list_del(&b->list);
+        buffer_recycle(b);
+    }
+}
+
+static void METHOD_IMPL(fail, int error)
+{
+    DPRINTF("giving up on message: %d\n", error);
+    this->error = error;
+    this->state = STATE_ERROR;
+    if(this->info.done)
+        this->info.done(this);
+}
+
+static void METHOD_IMPL(finish)
+{
+    DPRINTF("end of message\n");
+    this->state = STATE_EOF;
+    if(this->info.done)
+        this->info.done(this);
+}
+
+static inline struct http_slice sub_slice(struct http_slice s, size_t from,
+        size_t len)
+{
+    s.offset += from;
+    s.len = len;
+    return s;
 }
 
-#if 0 // no longer required - we're operating on a different buffer */
-/* basically strtok's the string, but doesn't modify it */
-static char **METHOD_IMPL(parse_header_string, char *c, unsigned int len)
+/* the next run of non-blanks in 'line' from *pos on, moving *pos past
+ * it. Empty when the line has run out */
+static struct http_slice next_token(const char *p, struct http_slice line,
+        size_t *pos)
 {
-    DPRINTF("Parsing HTTP Header line: %*s\n", (int)len, c);
+    *pos += http_skip_space(p + *pos, line.len - *pos);
+    size_t len = http_scan(p + *pos, line.len - *pos, HTTP_SET_SPACE);
+    struct http_slice token = sub_slice(line, *pos, len);
+    *pos += len;
+    return token;
+}
 
-    char *end = c + len;
-    char *colon = c;
-    char *value;
-    unsigned int i;
-    for(i = 0;i < len;i++, colon++)
+/* one complete line, without its line ending */
+static void METHOD_IMPL(read_line, struct http_slice line)
+{
+    if(line.len == 0)
     {
-        if(*colon == ':')
-            break;
+        DPRINTF("end of headers found\n");
+        this->state = STATE_BODY;
+        return;
     }
-    /* make sure we didn't get to end of string */
-    if(colon == end)
-        return NULL;
 
-    int name_len = colon - c;
-    size_t required_size = name_len;
+    const char *p = HTTP_SLICE_PTR(&this->msg, line);
+    size_t pos = 0;
+    if(this->state == STATE_REQUEST)
+    {
+        this->msg.request_type = next_token(p, line, &pos);
+        this->msg.request_path = next_token(p, line, &pos);
+        this->msg.http_version = next_token(p, line, &pos);
+        this->msg.direction = HTTP_REQUEST;
+        this->state = STATE_HEADERS;
+        DPRINTF("request: %.*s %.*s %.*s\n",
+                this->msg.request_type.len,
+                HTTP_SLICE_PTR(&this->msg, this->msg.request_type),
+                this->msg.request_path.len,
+                HTTP_SLICE_PTR(&this->msg, this->msg.request_path),
+                this->msg.http_version.len,
+                HTTP_SLICE_PTR(&this->msg, this->msg.http_version));
+    }
+    else if(this->state == STATE_RESPONSE)
+    {
+        this->msg.http_version = next_token(p, line, &pos);
+        struct http_slice code = next_token(p, line, &pos);
+        //ASSERT(strcmp(http_version, this->msg.http_version) == 0);
+        const char *c = HTTP_SLICE_PTR(&this->msg, code);
+        int i;
+        this->msg.response_code = 0;
+        for(i = 0;i < code.len && c[i] >= '0' && c[i] <= '9';i++)
+            this->msg.response_code = this->msg.response_code * 10 + c[i] - '0';
+        this->msg.response_msg = next_token(p, line, &pos);
+        this->msg.direction = HTTP_RESPONSE;
+        this->state = STATE_HEADERS;
+        DPRINTF("response: %.*s %d %.*s\n",
+                this->msg.http_version.len,
+                HTTP_SLICE_PTR(&this->msg, this->msg.http_version),
+                this->msg.response_code,
+                this->msg.response_msg.len,
+                HTTP_SLICE_PTR(&this->msg, this->msg.response_msg));
+    }
+    else
+    {
+        size_t colon = http_scan(p, line.len, HTTP_SET_COLON);
+        if(colon == line.len)
+            return;
+        if(this->msg.header_count == HTTP_MAX_HEADERS)
+        {
+            PRIV_CALL(this, fail, HTTP_ERR_TOO_MANY_HEADERS);
+            return;
+        }
+        size_t value = colon + 1;
+        value += http_skip_space(p + value, line.len - value);
+        size_t end = line.len;
+        while(end > value && (p[end - 1] == ' ' || p[end - 1] == '\t'))
+            end--;
+
+        struct http_header *header =
+            &this->msg.headers[this->msg.header_count++];
+        header->name = sub_slice(line, 0, colon);
+        header->value = sub_slice(line, value, end - value);
+        header->id = http_header_id(p, colon);
+        if(header->id != HTTP_HEADER_OTHER && !this->msg.known[header->id])
+            this->msg.known[header->id] = this->msg.header_count;
+    }
+}
+
+/* holds on to 'b' for the message's slices, returning its index or -1
+ * if the message has too many already */
+static int METHOD_IMPL(keep, buffer *b)
+{
+    if(this->msg.buffer_count == HTTP_MAX_BUFFERS)
+    {
+        PRIV_CALL(this, fail, HTTP_ERR_TOO_LARGE);
+        return -1;
+    }
+    this->msg.buffers[this->msg.buffer_count] = b;
+    return this->msg.buffer_count++;
+}
 
-    value = colon + 1;
-    for(i = required_size;i < len;i++, value++)
+/* adds to the line being collected in the arena, moving it to a new
+ * arena buffer when it doesn't fit. The old one is kept, earlier lines
+ * may be in it */
+static int METHOD_IMPL(collect, const char *p, size_t len)
+{
+    buffer *arena = this->arena;
+    if(!this->in_partial)
     {
-        if(*value != ' ' && *value != '\t')
-            break;
+        this->partial = arena ? arena->used : 0;
+        this->in_partial = 1;
     }
-    if(value == end)
-        return NULL;
+    size_t partial_len = arena ? arena->used - this->partial : 0;
+    if(!arena || arena->used + len > arena->size)
+    {
+        size_t size = partial_len + len;
+        buffer *fresh = buffer_get(size > HTTP_ARENA_SIZE ? size : HTTP_ARENA_SIZE);
+        int index = PRIV_CALL(this, keep, fresh);
+        if(index == -1)
+        {
+            buffer_recycle(fresh);
+            return -1;
+        }
+        if(partial_len)
+            memcpy(fresh->ptr, (char*)arena->ptr + this->partial, partial_len);
+        fresh->used = partial_len;
+        this->partial = 0;
+        this->arena = arena = fresh;
+        this->arena_index = index;
+    }
+    memcpy((char*)arena->ptr + arena->used, p, len);
+    arena->used += len;
+    return 0;
+}
+
+static int slice_is(struct http_message *msg, struct http_slice s,
+        const char *str)
+{
+    size_t len = strlen(str);
+    return s.len == len && strncasecmp(HTTP_SLICE_PTR(msg, s), str, len) == 0;
+}
+
+/* whether the last transfer coding in 'value' is chunked */
+static int is_chunked(struct http_message *msg, struct http_slice value)
+{
+    static const char chunked[] = "chunked";
+    size_t len = sizeof(chunked) - 1;
+    if(value.len < len)
+        return 0;
+    const char *p = HTTP_SLICE_PTR(msg, value);
+    size_t start = value.len - len;
+    if(strncasecmp(p + start, chunked, len) != 0)
+        return 0;
+    return start == 0 || p[start - 1] == ',' || p[start - 1] == ' ' ||
+        p[start - 1] == '\t';
+}
 
-    int value_len = end - value;
-    required_size += end - value;
-    required_size += 2 + 2 * sizeof(char*); // null chars, 2 ptrs
+/* the value of every Content-Length header, which have to agree.
+ * Returns -1 if one isn't a number or they differ, 0 if there are
+ * none, 1 otherwise */
+static int content_length(struct http_message *msg, uint64_t *length)
+{
+    int found = 0;
+    int i;
+    for(i = 0;i < msg->header_count;i++)
+    {
+        if(msg->headers[i].id != HTTP_HEADER_CONTENT_LENGTH)
+            continue;
+        struct http_slice value = msg->headers[i].value;
+        const char *p = HTTP_SLICE_PTR(msg, value);
+        uint64_t n = 0;
+        int j;
+        if(value.len == 0)
+            return -1;
+        for(j = 0;j < value.len;j++)
+        {
+            if(p[j] < '0' || p[j] > '9' || n > (UINT64_MAX - 9) / 10)
+                return -1;
+            n = n * 10 + p[j] - '0';
+        }
+        if(found && n != *length)
+            return -1;
+        *length = n;
+        found = 1;
+    }
+    return found;
+}
 
-    char *hdr = (char*)malloc(required_size);
+static struct http_header *METHOD_IMPL(get_header_id, int id)
+{
+    if(this->state <= STATE_HEADERS || this->state == STATE_ERROR)
+        return NULL;
+    if(id <= HTTP_HEADER_OTHER || id >= HTTP_HEADER_COUNT)
+        return NULL;
+    return HTTP_KNOWN_HEADER(&this->msg, id);
+}
 
-    memcpy(hdr + 2, c, name_len);
-    *(hdr + name_len) = '\0';
+static struct http_header *METHOD_IMPL(get_header, const char *name)
+{
+    int i;
+    if(this->state <= STATE_HEADERS || this->state == STATE_ERROR)
+        return NULL;
+    int id = http_header_id(name, strlen(name));
+    if(id != HTTP_HEADER_OTHER)
+        return HTTP_KNOWN_HEADER(&this->msg, id);
+    /* only the names that aren't known can be it */
+    for(i = 0;i < this->msg.header_count;i++)
+    {
+        if(this->msg.headers[i].id == HTTP_HEADER_OTHER &&
+                slice_is(&this->msg, this->msg.headers[i].name, name))
+            return &this->msg.headers[i];
+    }
+    return NULL;
+}
 
-    memcpy(hdr+name_len+3, value, value_len);
-    *(hdr + name_len + 1 + value_len) = '\0';
+/* works out how the body ends from the headers (RFC 7230 3.3.3), the
+ * request method isn't known here so a response to HEAD is taken to
+ * have the body its headers describe */
+static void METHOD_IMPL(start_body)
+{
+    struct http_message *msg = &this->msg;
+    struct http_header *te =
+        HTTP_KNOWN_HEADER(msg, HTTP_HEADER_TRANSFER_ENCODING);
+    uint64_t length = 0;
+    int has_length = content_length(msg, &length);
 
-    char **hdrs = (char**)hdr;
-    hdrs[0] = hdr + 2;
-    hdrs[1] = hdrs[0] + name_len + 1;
+    if(msg->direction == HTTP_RESPONSE && (msg->response_code < 200 ||
+            msg->response_code == 204 || msg->response_code == 304))
+        msg->body = HTTP_BODY_NONE;
+    else if(te && is_chunked(msg, te->value))
+        msg->body = HTTP_BODY_CHUNKED;
+    else if(te && msg->direction == HTTP_REQUEST)
+    {
+        PRIV_CALL(this, fail, HTTP_ERR_BAD_LENGTH);
+        return;
+    }
+    else if(te)
+        msg->body = HTTP_BODY_CLOSE;
+    else if(has_length == -1)
+    {
+        PRIV_CALL(this, fail, HTTP_ERR_BAD_LENGTH);
+        return;
+    }
+    else if(has_length)
+        msg->body = length ? HTTP_BODY_LENGTH : HTTP_BODY_NONE;
+    else if(msg->direction == HTTP_RESPONSE)
+        msg->body = HTTP_BODY_CLOSE;
+    else
+        msg->body = HTTP_BODY_NONE;
 
-    return hdrs;
+    DPRINTF("body: %d, length %llu\n", msg->body, (unsigned long long)length);
+    msg->content_length = length;
+    this->remaining = length;
+    this->chunk_state = CHUNK_SIZE;
+    this->chunk_digits = 0;
+    if(msg->body == HTTP_BODY_NONE)
+        PRIV_CALL(this, finish);
 }
-#endif
 
-static void METHOD_IMPL(read_headers, buffer *b)
+/* hands body bytes [pos, pos + len) of 'b' to the consumer, 'b' itself
+ * if that's all of it, otherwise a slice of it. Returns 1 if 'b' was
+ * handed over */
+static int METHOD_IMPL(deliver, buffer *b, size_t pos, size_t len)
 {
-    off_t pos = CALL(this->buffer, seek, 0, SEEK_CUR);
-    CALL(this->buffer, write_buffer, buffer_dup(b));
-    struct search_state *state = this->search;
-    if(!state)
+    if(!this->info.body || len == 0)
+        return 0;
+    if(pos == 0 && len == b->used)
+    {
+        this->info.body(this, b);
+        return 1;
+    }
+    buffer *slice = buffer_slice(b, pos, len);
+    if(!slice)
     {
-        state = this->search = (struct search_state*)malloc(
-            sizeof(struct search_state));
-        strcpy(state->needle, "\r\n");
-        state->pos = 0;
+        PRIV_CALL(this, fail, HTTP_ERR_NO_MEMORY);
+        return 0;
     }
-    char *ptr = (char*)b->ptr;
-    for(;b->pos < b->used;b->pos++, ptr++, pos++)
+    this->info.body(this, slice);
+    return 0;
+}
+
+static inline int hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* everything in a chunked body but the data: chunk sizes, extensions,
+ * the line ends after the data, and trailers, which are skipped over.
+ * Nothing is kept across calls but the state, so lines can be split
+ * anywhere. Returns how much of p[0..len) it used */
+static size_t METHOD_IMPL(read_chunk_framing, const char *p, size_t len)
+{
+    size_t i = 0;
+    while(i < len && this->chunk_state != CHUNK_DATA &&
+            this->state == STATE_BODY)
     {
-        if(*ptr == state->needle[state->pos])
+        char c = p[i];
+        int digit;
+        switch(this->chunk_state)
         {
-            if(state->needle[++state->pos] == '\0')
+        case CHUNK_SIZE:
+            digit = hex_value(c);
+            if(digit != -1 && this->chunk_digits < CHUNK_MAX_DIGITS)
             {
-                size_t line_len = pos+1;
-                if(line_len == strlen(state->needle))
-                {
-                    DPRINTF("end of headers found\n");
-                    this->state = STATE_BODY;
-                }
+                this->remaining = this->remaining * 16 + digit;
+                this->chunk_digits++;
+                i++;
+            }
+            else if(this->chunk_digits && (c == ';' || c == ' ' ||
+                    c == '\t' || c == '\r' || c == '\n'))
+                this->chunk_state = CHUNK_EXT;
+            else
+                PRIV_CALL(this, fail, HTTP_ERR_BAD_CHUNK);
+            break;
+        case CHUNK_EXT:
+            i += http_scan(p + i, len - i, HTTP_SET_LF);
+            if(i == len)
+                break;
+            i++;
+            this->chunk_digits = 0;
+            this->chunk_state = this->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        case CHUNK_DATA_CR:
+            if(c == '\r')
+            {
+                this->chunk_state = CHUNK_DATA_LF;
+                i++;
+                break;
+            }
+            /* fall through, a bare LF is fine */
+        case CHUNK_DATA_LF:
+            if(c != '\n')
+            {
+                PRIV_CALL(this, fail, HTTP_ERR_BAD_CHUNK);
+                break;
+            }
+            this->chunk_state = CHUNK_SIZE;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if(c == '\r')
+            {
+                this->chunk_state = CHUNK_TRAILER_LF;
+                i++;
+            }
+            else if(c == '\n')
+            {
+                i++;
+                PRIV_CALL(this, finish);
+            }
+            else
+                this->chunk_state = CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            i += http_scan(p + i, len - i, HTTP_SET_LF);
+            if(i == len)
+                break;
+            i++;
+            this->chunk_state = CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER_LF:
+            if(c != '\n')
+            {
+                PRIV_CALL(this, fail, HTTP_ERR_BAD_CHUNK);
+                break;
+            }
+            i++;
+            PRIV_CALL(this, finish);
+            break;
+        }
+    }
+    return i;
+}
 
-                char *hdr_str = (char*)malloc(line_len);
-                CALL(this->buffer, seek, 0, SEEK_SET);
-                CALL(this->buffer, read, hdr_str, line_len);
-                hdr_str[line_len-2] = '\0';
+/* passes the body on as it comes in. Takes 'b', reading from b->pos */
+static void METHOD_IMPL(read_body, buffer *b)
+{
+    size_t pos = b->pos;
+    size_t used = b->used;
+    char taken = 0;
+    while(pos < used && this->state == STATE_BODY && !taken)
+    {
+        size_t left = used - pos;
+        size_t n;
+        if(this->msg.body == HTTP_BODY_CLOSE)
+        {
+            taken = PRIV_CALL(this, deliver, b, pos, left);
+            pos += left;
+        }
+        else if(this->msg.body == HTTP_BODY_LENGTH ||
+                this->chunk_state == CHUNK_DATA)
+        {
+            n = left < this->remaining ? left : this->remaining;
+            taken = PRIV_CALL(this, deliver, b, pos, n);
+            pos += n;
+            this->remaining -= n;
+            if(this->remaining)
+                continue;
+            if(this->msg.body == HTTP_BODY_LENGTH)
+                PRIV_CALL(this, finish);
+            else
+                this->chunk_state = CHUNK_DATA_CR;
+        }
+        else
+            pos += PRIV_CALL(this, read_chunk_framing,
+                (const char*)b->ptr + pos, left);
+    }
+    if(taken)
+        return;
+    /* the start of the next message, pipelined behind this one */
+    if(this->state == STATE_EOF && pos < used)
+    {
+        b->pos = pos;
+        list_add_tail(&b->list, &this->pending);
+    }
+    else
+        buffer_recycle(b);
+}
 
-                off_t end = CALL(this->buffer, seek, 0, SEEK_END);
-                ASSERT(end >= line_len);
-                CALL(this->buffer, rtruncate, 
-                    end - line_len);
+/* Lines are found with http_scan straight in the incoming buffer, and
+ * the message takes a reference to it (buffer_dup) once a line points
+ * into it. 'b' itself goes on to the body, or the next message, or is
+ * recycled. Only a line split across buffers is copied, into the arena */
+static void METHOD_IMPL(read_headers, buffer *b)
+{
+    const char *base = (const char*)b->ptr;
+    size_t pos = b->pos;
+    int index = -1;
+    while(pos < b->used && this->state <= STATE_HEADERS)
+    {
+        size_t left = b->used - pos;
+        size_t n = http_scan(base + pos, left, HTTP_SET_LF);
+        this->header_size += n == left ? left : n + 1;
+        if(this->header_size > HTTP_MAX_HEADER_SIZE)
+        {
+            PRIV_CALL(this, fail, HTTP_ERR_TOO_LARGE);
+            break;
+        }
+        if(n == left)
+        {
+            PRIV_CALL(this, collect, base + pos, left);
+            pos = b->used;
+            break;
+        }
 
-                if(this->state == STATE_REQUEST)
-                {
-                    char *request_type = strtok(hdr_str, " \t");
-                    char *request_path = strtok(NULL, " \t");
-                    char *http_version = strtok(NULL, " \t");
-                    this->msg.request_type = strdup(request_type);
-                    this->msg.request_path = strdup(request_path);
-                    this->msg.http_version = strdup(http_version);
-                    this->state = STATE_HEADERS;
-                    DPRINTF("request: %s %s %s\n",
-                            request_type,
-                            request_path,
-                            http_version);
-                }
-                else if(this->state == STATE_RESPONSE)
+        struct http_slice line = { pos, n, 0 };
+        char in_arena = this->in_partial;
+        if(in_arena)
+        {
+            int collected = PRIV_CALL(this, collect, base + pos, n);
+            if(collected == -1)
+                break;
+            line.offset = this->partial;
+            line.len = this->arena->used - this->partial;
+            line.buf = this->arena_index;
+            this->in_partial = 0;
+        }
+        pos += n + 1;
+
+        /* a bare LF ends a line as well */
+        size_t line_size = line.len + 1;
+        const char *text = in_arena ? HTTP_SLICE_PTR(&this->msg, line) :
+            base + line.offset;
+        if(line.len && text[line.len - 1] == '\r')
+            line.len--;
+        /* empty lines before the request or status line are skipped
+         * (RFC 7230 3.5), clients send a stray CRLF after a body. They
+         * aren't the start of a message, so they don't count towards it
+         * and don't take up room in the arena */
+        if(line.len == 0 && this->state < STATE_HEADERS)
+        {
+            this->header_size -= line_size;
+            if(in_arena)
+                this->arena->used = line.offset;
+            continue;
+        }
+        if(!in_arena)
+        {
+            if(index == -1)
+            {
+                buffer *ref = buffer_dup(b);
+                if(!ref)
                 {
-                    char *http_version = strtok(hdr_str, " \t");
-                    char *response_code = strtok(NULL, " \t");
-                    char *response_msg = strtok(NULL, " \t");
-                    //ASSERT(strcmp(http_version, this->msg.http_version) == 0);
-                    this->msg.response_code = strtoll(response_code, NULL, 0);
-                    this->msg.response_msg = strdup(response_msg);
-                    this->state = STATE_HEADERS;
-                    DPRINTF("response: %s %d %s\n",
-                            http_version,
-                            this->msg.response_code,
-                            response_msg);
+                    PRIV_CALL(this, fail, HTTP_ERR_NO_MEMORY);
+                    break;
                 }
-                else
+                index = PRIV_CALL(this, keep, ref);
+                if(index == -1)
                 {
-                    char *name = hdr_str, *value = NULL, *i;
-                    for(i = hdr_str;*i != '\0';i++)
-                    {
-                        if(*i == ':')
-                        {
-                            *i = '\0';
-                            value = i+1;
-                            break;
-                        }
-                    }
-                    if(value)
-                    {
-                        for(;(*value == ' '  || *value == '\t') &&  
-                              *value != '\0'; value++);
-                        this->msg.headers[this->msg.header_count] =
-                            (char**)malloc(2 * sizeof(char*));
-                        this->msg.headers[this->msg.header_count][0] =
-                            strdup(name);
-                        this->msg.headers[this->msg.header_count][1] =
-                            strdup(value);
-                        this->msg.header_count++;
-                    }
+                    buffer_recycle(ref);
+                    break;
                 }
-                free(hdr_str);
-                state->pos = 0;
-                pos = -1;
             }
+            line.buf = index;
         }
-        else
-        {
-            state->pos = 0;
-        }
+        PRIV_CALL(this, read_line, line);
     }
-    buffer_recycle(b);
+    b->pos = pos;
+
+    if(this->state == STATE_BODY)
+        PRIV_CALL(this, start_body);
+    /* whatever follows the headers, the body or the next message */
+    if((this->state == STATE_BODY || this->state == STATE_EOF) &&
+            pos < b->used)
+        PRIV_CALL(this, read_body, b);
+    else
+        buffer_recycle(b);
 }
 
 static void METHOD_IMPL(feed_data, buffer *b)
@@ -201,12 +609,105 @@ static void METHOD_IMPL(feed_data, buffer *b)
     case STATE_HEADERS:
         PRIV_CALL(this, read_headers, b);
         break;
+    case STATE_BODY:
+        PRIV_CALL(this, read_body, b);
+        break;
+    case STATE_EOF:
+        list_add_tail(&b->list, &this->pending);
+        break;
+    default:
+        buffer_recycle(b);
+        break;
     }
 }
 
-static char ***METHOD_IMPL(get_headers, int *header_count)
+static void METHOD_IMPL(feed_eof)
+{
+    DPRINTF("eof in state: %d\n", this->state);
+    if(this->state == STATE_BODY && this->msg.body == HTTP_BODY_CLOSE)
+        PRIV_CALL(this, finish);
+    /* nothing at all is a connection closing between messages */
+    else if(this->state <= STATE_BODY && this->header_size)
+        PRIV_CALL(this, fail, HTTP_ERR_TRUNCATED);
+}
+
+static void METHOD_IMPL(reset)
 {
-    if(this->state <= STATE_HEADERS)
+    int direction = this->msg.direction;
+    release(this);
+    memset(&this->msg, '\0', sizeof(struct http_message));
+    this->msg.direction = direction;
+    this->state = direction == HTTP_RESPONSE ? STATE_RESPONSE : STATE_REQUEST;
+    this->error = HTTP_ERR_NONE;
+    this->arena = NULL;
+    this->arena_index = 0;
+    this->partial = 0;
+    this->in_partial = 0;
+    this->header_size = 0;
+    this->remaining = 0;
+    this->chunk_state = CHUNK_SIZE;
+    this->chunk_digits = 0;
+
+    /* if one of these ends the next message too, it and the ones after
+     * it go back on the list in the same order */
+    struct list_head pending;
+    INIT_LIST_HEAD(&pending);
+    list_splice_init(&this->pending, &pending);
+    while(!list_empty(&pending))
+    {
+        buffer *b = list_entry(pending.next, buffer, list);
+        list_del(&b->list);
+        PRIV_CALL(this, feed_data, b);
+    }
+}
+
+static char METHOD_IMPL(complete)
+{
+    return this->state == STATE_EOF;
+}
+
+/* whether the comma separated list 'value' has 'token' in it, in any
+ * case */
+static int has_token(struct http_message *msg, struct http_slice value,
+        const char *token)
+{
+    const char *p = HTTP_SLICE_PTR(msg, value);
+    size_t len = strlen(token);
+    size_t pos = 0;
+    while(pos < value.len)
+    {
+        pos += http_skip_space(p + pos, value.len - pos);
+        size_t end = pos;
+        while(end < value.len && p[end] != ',')
+            end++;
+        size_t token_end = end;
+        while(token_end > pos &&
+                (p[token_end - 1] == ' ' || p[token_end - 1] == '\t'))
+            token_end--;
+        if(token_end - pos == len && strncasecmp(p + pos, token, len) == 0)
+            return 1;
+        pos = end + 1;
+    }
+    return 0;
+}
+
+static char METHOD_IMPL(keep_alive)
+{
+    if(this->state != STATE_EOF || this->msg.body == HTTP_BODY_CLOSE)
+        return 0;
+    struct http_header *connection =
+        HTTP_KNOWN_HEADER(&this->msg, HTTP_HEADER_CONNECTION);
+    if(connection && has_token(&this->msg, connection->value, "close"))
+        return 0;
+    /* persistent by default from 1.1 on, 1.0 has to ask */
+    if(slice_is(&this->msg, this->msg.http_version, "HTTP/1.1"))
+        return 1;
+    return connection && has_token(&this->msg, connection->value, "keep-alive");
+}
+
+static struct http_header *METHOD_IMPL(get_headers, int *header_count)
+{
+    if(this->state <= STATE_HEADERS || this->state == STATE_ERROR)
         return NULL;
     *header_count = this->msg.header_count;
     return this->msg.headers;
@@ -216,12 +717,28 @@ VIRTUAL(Object)
     VMETHOD_BASE(Object, construct);
     VMETHOD_BASE(Object, deconstruct);
     VMETHOD(feed_data);
+    VMETHOD(feed_eof);
+    VMETHOD(reset);
+    VMETHOD(complete);
+    VMETHOD(keep_alive);
     VMETHOD(get_headers);
+    VMETHOD(get_header);
+    VMETHOD(get_header_id);
+
+    VPOOL(HTTP_POOL_PREALLOC, CLASS_POOL_THREAD_LOCAL);
 
-    VFIELD(buffer) = NULL;
-    VFIELD(search) = NULL;
     VFIELD(state) = STATE_REQUEST;
+    VFIELD(error) = HTTP_ERR_NONE;
+    VFIELD(arena) = NULL;
+    VFIELD(arena_index) = 0;
+    VFIELD(partial) = 0;
+    VFIELD(in_partial) = 0;
+    VFIELD(header_size) = 0;
+    VFIELD(remaining) = 0;
+    VFIELD(chunk_state) = CHUNK_SIZE;
+    VFIELD(chunk_digits) = 0;
     memset(&this->msg, '\0', sizeof(struct http_message));
+    memset(&this->info, '\0', sizeof(struct http_info));
 END_VIRTUAL
 #undef CLASS_NAME // Http
 
@@ -0,0 +1,176 @@
+
+#include <string.h>
+
+#include "http_scan.h"
+#include "debug.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+static size_t scan_scalar(const char *p, size_t len, const char *set)
+{
+    /* sets are short, so unused slots repeat the first byte rather than
+     * looping over the set for every byte */
+    int n = strlen(set);
+    char c0 = set[0];
+    char c1 = set[n > 1 ? 1 : 0];
+    char c2 = set[n > 2 ? 2 : 0];
+    char c3 = set[n > 3 ? 3 : 0];
+    size_t i;
+    for(i = 0;i < len;i++)
+    {
+        char c = p[i];
+        if(c == c0 || c == c1 || c == c2 || c == c3)
+            return i;
+    }
+    return len;
+}
+
+#ifdef HTTP_SCAN_X86
+/* SSE2 is always there on x86-64, it handles what's too short for the
+ * wider loops. Vectors past the first may overlap the previous one,
+ * which is fine since the overlapped bytes are known not to match */
+static inline size_t scan_short(const char *p, size_t len, const char *set,
+        int n)
+{
+    if(len < 16)
+        return scan_scalar(p, len, set);
+    __m128i s0 = _mm_set1_epi8(set[0]);
+    __m128i s1 = _mm_set1_epi8(set[n > 1 ? 1 : 0]);
+    __m128i s2 = _mm_set1_epi8(set[n > 2 ? 2 : 0]);
+    __m128i s3 = _mm_set1_epi8(set[n > 3 ? 3 : 0]);
+    size_t i = 0;
+    for(;;)
+    {
+        if(i + 16 > len)
+            i = len - 16;
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(c, s0), _mm_cmpeq_epi8(c, s1)),
+            _mm_or_si128(_mm_cmpeq_epi8(c, s2), _mm_cmpeq_epi8(c, s3)));
+        unsigned int mask = _mm_movemask_epi8(m);
+        if(mask)
+            return i + __builtin_ctz(mask);
+        if(i + 16 >= len)
+            return len;
+        i += 16;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const char *p, size_t len, const char *set)
+{
+    int n = strlen(set);
+    if(len < 16)
+        return scan_scalar(p, len, set);
+    char needle[16] = { 0 };
+    memcpy(needle, set, n);
+    __m128i ns = _mm_loadu_si128((const __m128i*)needle);
+    size_t i = 0;
+    for(;;)
+    {
+        if(i + 16 > len)
+            i = len - 16;
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + i));
+        int index = _mm_cmpestri(ns, n, c, 16, _SIDD_UBYTE_OPS |
+            _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if(index < 16)
+            return i + index;
+        if(i + 16 >= len)
+            return len;
+        i += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *p, size_t len, const char *set)
+{
+    int n = strlen(set);
+    if(len < 32)
+        return scan_short(p, len, set, n);
+    __m256i s0 = _mm256_set1_epi8(set[0]);
+    __m256i s1 = _mm256_set1_epi8(set[n > 1 ? 1 : 0]);
+    __m256i s2 = _mm256_set1_epi8(set[n > 2 ? 2 : 0]);
+    __m256i s3 = _mm256_set1_epi8(set[n > 3 ? 3 : 0]);
+    size_t i = 0;
+    for(;;)
+    {
+        if(i + 32 > len)
+            i = len - 32;
+        __m256i c = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, s0), _mm256_cmpeq_epi8(c, s1)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, s2), _mm256_cmpeq_epi8(c, s3)));
+        unsigned int mask = _mm256_movemask_epi8(m);
+        if(mask)
+            return i + __builtin_ctz(mask);
+        if(i + 32 >= len)
+            return len;
+        i += 32;
+    }
+}
+#endif
+
+static size_t (*scan_impl)(const char *p, size_t len, const char *set) =
+    scan_scalar;
+static int scan_selected = HTTP_SCAN_SCALAR;
+
+size_t http_scan(const char *p, size_t len, const char *set)
+{
+    ASSERT(strlen(set) <= HTTP_SCAN_SET_MAX);
+    return scan_impl(p, len, set);
+}
+
+size_t http_skip_space(const char *p, size_t len)
+{
+    /* almost always zero or one of them, not worth a vector */
+    size_t i;
+    for(i = 0;i < len && (p[i] == ' ' || p[i] == '\t');i++);
+    return i;
+}
+
+int http_scan_select(int impl)
+{
+    switch(impl)
+    {
+    case HTTP_SCAN_SCALAR:
+        scan_impl = scan_scalar;
+        break;
+#ifdef HTTP_SCAN_X86
+    case HTTP_SCAN_SSE42:
+        if(!__builtin_cpu_supports("sse4.2"))
+            return -1;
+        scan_impl = scan_sse42;
+        break;
+    case HTTP_SCAN_AVX2:
+        if(!__builtin_cpu_supports("avx2"))
+            return -1;
+        scan_impl = scan_avx2;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    scan_selected = impl;
+    return 0;
+}
+
+const char *http_scan_name(void)
+{
+    static const char *names[] = { "scalar", "sse4.2", "avx2" };
+    return names[scan_selected];
+}
+
+__attribute__((constructor)) static void http_scan_init(void)
+{
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+#endif
+    if(http_scan_select(HTTP_SCAN_AVX2) == 0)
+        return;
+    if(http_scan_select(HTTP_SCAN_SSE42) == 0)
+        return;
+    http_scan_select(HTTP_SCAN_SCALAR);
+}
@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "relay.h"
+
+#include "debug.h"
+
+/* how much one callback moves before letting the rest of the loop run */
+#define RELAY_PUMP_MAX  (4*1024*1024)
+
+static int direction_of(Relay this, struct relay_flow *f)
+{
+    return f == &this->flows[0] ? RELAY_A_TO_B : RELAY_B_TO_A;
+}
+
+/* once every direction is done, tells the owner. Nothing may touch the
+ * relay after this has been called */
+static int settle(Relay this, int result)
+{
+    if(this->finished || !this->flows[0].done || !this->flows[1].done)
+        return result;
+    this->finished = 1;
+    if(this->info.on_done)
+        this->info.on_done(this);
+    return EV_DONE;
+}
+
+/* == splice path == */
+
+static void fail(Relay this, const char *call)
+{
+    DPRINTF("%s failed: %s (%d)\n", call, strerror(errno), errno);
+    this->error = errno;
+    this->flows[0].done = 1;
+    this->flows[1].done = 1;
+}
+
+static void close_write(struct relay_end *end)
+{
+    if(end->is_socket && shutdown(end->fd, SHUT_WR) == -1 && errno != ENOTCONN)
+        DPRINTF("Error sending EOF: %s (%d)\n", strerror(errno), errno);
+}
+
+/* moves what it can across, through the flow's pipe. Returns non-zero
+ * if it stopped with more to do straight away */
+static int pump(Relay this, struct relay_flow *f)
+{
+    size_t moved = 0;
+    while(!f->done)
+    {
+        int progress = 0;
+        if(f->piped)
+        {
+            ssize_t len = splice(f->pipe[0], NULL, f->to->fd, NULL, f->piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(len > 0)
+            {
+                f->piped -= len;
+                f->bytes += len;
+                moved += len;
+                progress = 1;
+            }
+            else if(len == -1 && errno != EAGAIN && errno != EINTR)
+            {
+                fail(this, "splice() out");
+                return 0;
+            }
+        }
+        if(!f->eof && f->piped < f->pipe_size)
+        {
+            ssize_t len = splice(f->from->fd, NULL, f->pipe[1], NULL,
+                f->pipe_size - f->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(len > 0)
+            {
+                f->piped += len;
+                progress = 1;
+            }
+            else if(len == 0)
+            {
+                f->eof = 1;
+                progress = 1;
+            }
+            else if(errno != EAGAIN && errno != EINTR)
+            {
+                fail(this, "splice() in");
+                return 0;
+            }
+        }
+        if(f->eof && f->piped == 0)
+        {
+            f->done = 1;
+            close_write(f->to);
+            return 0;
+        }
+        /* nothing moved either way, wait to be told something's ready */
+        if(!progress)
+            return 0;
+        if(moved >= RELAY_PUMP_MAX)
+            return 1;
+    }
+    return 0;
+}
+
+static struct relay_end *end_of(Relay this, int fd)
+{
+    return this->ends[0].fd == fd ? &this->ends[0] : &this->ends[1];
+}
+
+static int readable(event e, struct event_info *info)
+{
+    Relay this = (Relay)info->context;
+    struct relay_end *end = end_of(this, info->fd);
+    int more = pump(this, &this->flows[end - this->ends]);
+    return settle(this, more ? EV_READ_PENDING : EV_DONE);
+}
+
+static int writable(event e, struct event_info *info)
+{
+    Relay this = (Relay)info->context;
+    struct relay_end *end = end_of(this, info->fd);
+    int more = pump(this, &this->flows[1 - (end - this->ends)]);
+    return settle(this, more ? EV_WRITE_PENDING : EV_DONE);
+}
+
+static int exception(event e, struct event_info *info)
+{
+    /* the error comes out of whichever splice touches the fd next */
+    Relay this = (Relay)info->context;
+    pump(this, &this->flows[0]);
+    pump(this, &this->flows[1]);
+    return settle(this, EV_DONE);
+}
+
+/* takes the fds over from any Sockets. Returns -1 if one of them can't
+ * give its fd up, leaving the rest for the buffer path */
+static int take_fds(Relay this)
+{
+    int i;
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_end *end = &this->ends[i];
+        if(!end->socket)
+            continue;
+        int fd = CALL(end->socket, detach);
+        if(fd == -1)
+            return -1;
+        end->detached = end->socket;
+        end->socket = NULL;
+        end->fd = fd;
+    }
+    return 0;
+}
+
+static int setup_splice(Relay this)
+{
+    int i;
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_end *end = &this->ends[i];
+        struct stat st;
+        if(fstat(end->fd, &st) == -1)
+            return -1;
+        end->is_socket = S_ISSOCK(st.st_mode);
+        /* files can't be polled, and never need to be */
+        if(S_ISREG(st.st_mode))
+            continue;
+
+        struct relay_flow *out = &this->flows[i];
+        struct relay_flow *in = &this->flows[1 - i];
+        struct event_info event_info = {
+            .fd = end->fd,
+            .events = EV_EXCEPT | (out->active ? EV_READ : 0) |
+                (in->active ? EV_WRITE : 0),
+            .context = this,
+            .read = readable,
+            .write = writable,
+            .except = exception,
+        };
+        int result = event_register(this->info.loop, &event_info, &end->event);
+        if(result != EVENTMGR_SUCCESS)
+        {
+            DPRINTF("Failed to register event: %s (%d)\n",
+                eventmanager_strerror(result), result);
+            end->event = NULL;
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if(!this->ends[0].event && !this->ends[1].event)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_flow *f = &this->flows[i];
+        if(!f->active)
+        {
+            f->done = 1;
+            close_write(f->to);
+            continue;
+        }
+        if(pipe2(f->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+            return -1;
+        /* a bigger pipe means fewer trips round the loop */
+        fcntl(f->pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+        int size = fcntl(f->pipe[1], F_GETPIPE_SZ);
+        f->pipe_size = size > 0 ? size : 64*1024;
+        /* a file source is only ever pumped from the writing side,
+         * which needs a first kick */
+        if(f->to->event)
+            event_modify(f->to->event, EV_ADD | EV_WRITE);
+    }
+    return 0;
+}
+
+/* == buffer path == */
+
+static void forward(Relay this, struct relay_flow *f);
+
+static void discard(Socket s)
+{
+    buffer *b;
+    while((b = CALL((StringIO)s, read_buffer)))
+        buffer_recycle(b);
+}
+
+static void forget(Socket s)
+{
+}
+
+static struct relay_end *socket_end(Relay this, Socket s)
+{
+    return this->ends[0].socket == s ? &this->ends[0] : &this->ends[1];
+}
+
+/* nothing else will be sent this way */
+static void flow_eof(struct relay_flow *f)
+{
+    f->eof = 1;
+    f->done = 1;
+    if(f->to->socket)
+        CALL(f->to->socket, send_eof);
+}
+
+static void forward(Relay this, struct relay_flow *f)
+{
+    Socket from = f->from->socket;
+    Socket to = f->to->socket;
+    buffer *b;
+    while(CALL(to, writable) && (b = CALL((StringIO)from, read_buffer)))
+    {
+        f->bytes += b->used;
+        if(this->info.transform)
+            b = this->info.transform(this, direction_of(this, f), b);
+        if(b && CALL((StringIO)to, write_buffer, b) == -1)
+            buffer_recycle(b);
+    }
+    if(!CALL(to, writable))
+    {
+        /* carries on from write_drained */
+        CALL(from, pause_read);
+        return;
+    }
+    if(CALL(from, eof))
+        flow_eof(f);
+}
+
+static void data_available(Socket s)
+{
+    Relay this = (Relay)s->info.context;
+    struct relay_flow *f = &this->flows[socket_end(this, s) - this->ends];
+    if(f->done)
+        discard(s);
+    else
+        forward(this, f);
+    settle(this, EV_DONE);
+}
+
+static void write_drained(Socket s)
+{
+    Relay this = (Relay)s->info.context;
+    struct relay_flow *f = &this->flows[1 - (socket_end(this, s) - this->ends)];
+    if(f->done)
+        return;
+    CALL(f->from->socket, resume_read);
+    forward(this, f);
+    settle(this, EV_DONE);
+}
+
+static void socket_freed(Socket s)
+{
+    Relay this = (Relay)s->info.context;
+    struct relay_end *end = socket_end(this, s);
+    struct relay_flow *out = &this->flows[end - this->ends];
+    struct relay_flow *in = &this->flows[1 - (end - this->ends)];
+    end->socket = NULL;
+
+    /* it went away with its EOF still to pass on */
+    if(!out->done)
+        flow_eof(out);
+    /* nothing more can be delivered to it, let the other side drain */
+    if(!in->done)
+    {
+        this->error = EPIPE;
+        in->done = 1;
+        if(in->from->socket)
+            CALL(in->from->socket, resume_read);
+    }
+    settle(this, EV_DONE);
+}
+
+static int setup_buffers(Relay this)
+{
+    int i;
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_end *end = &this->ends[i];
+        if(end->socket)
+        {
+            end->socket->info.context = this;
+            end->socket->info.data_available = data_available;
+            end->socket->info.on_free = socket_freed;
+            end->socket->info.write_drained = write_drained;
+        }
+        else
+        {
+            struct socket_info socket_info = {
+                .sock_fd = end->fd,
+                .loop = this->info.loop,
+                .context = this,
+                .data_available = data_available,
+                .on_free = socket_freed,
+                .write_drained = write_drained,
+            };
+            end->socket = NEW(Socket, &socket_info);
+            if(!end->socket)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            end->fd = -1;
+        }
+        /* hold nothing back, it's only going to be passed on */
+        CALL(end->socket, set_delivery, 0, 0);
+    }
+
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_flow *f = &this->flows[i];
+        if(!f->active)
+            flow_eof(f);
+    }
+    /* anything the sockets had already read */
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_flow *f = &this->flows[i];
+        if(f->done)
+            discard(f->from->socket);
+        else
+            forward(this, f);
+    }
+    return 0;
+}
+
+/* hands what's left of both ends back to the system */
+static void release_ends(Relay this)
+{
+    int i;
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_end *end = &this->ends[i];
+        struct relay_flow *f = &this->flows[i];
+        if(end->event)
+            event_deregister(end->event);
+        if(end->fd != -1)
+            close(end->fd);
+        if(end->detached)
+        {
+            end->detached->info.on_free = forget;
+            DELETE(end->detached);
+        }
+        /* a socket may be part way through one of its own callbacks, so
+         * it's left to flush and free itself once its peer closes */
+        if(end->socket)
+        {
+            end->socket->info.context = NULL;
+            end->socket->info.data_available = discard;
+            end->socket->info.on_free = forget;
+            end->socket->info.write_drained = NULL;
+            CALL(end->socket, resume_read);
+            CALL(end->socket, send_eof);
+        }
+        if(f->pipe[0] != -1)
+            close(f->pipe[0]);
+        if(f->pipe[1] != -1)
+            close(f->pipe[1]);
+    }
+}
+
+#define CLASS_NAME(a,b) a## Relay ##b
+Relay METHOD_IMPL(construct, struct relay_info *info)
+{
+    SUPER_CALL(Object, this, construct);
+    this->info = *info;
+
+    int i;
+    for(i = 0;i < 2;i++)
+    {
+        struct relay_end *end = &this->ends[i];
+        end->socket = i == 0 ? info->a : info->b;
+        end->fd = end->socket ? -1 : (i == 0 ? info->a_fd : info->b_fd);
+        end->detached = NULL;
+        end->event = NULL;
+        end->is_socket = 0;
+
+        struct relay_flow *f = &this->flows[i];
+        f->from = &this->ends[i];
+        f->to = &this->ends[1 - i];
+        f->pipe[0] = f->pipe[1] = -1;
+        f->piped = 0;
+        f->pipe_size = 0;
+        f->active = (info->directions & (i == 0 ? RELAY_A_TO_B : RELAY_B_TO_A)) != 0;
+        f->eof = 0;
+        f->done = 0;
+        f->bytes = 0;
+    }
+
+    /* plain forwarding never needs to see the data */
+    this->splicing = !info->transform && take_fds(this) == 0;
+    int result = this->splicing ? setup_splice(this) : setup_buffers(this);
+    if(result == -1)
+    {
+        DPRINTF("Failed to set up relay: %s (%d)\n", strerror(errno), errno);
+        release_ends(this);
+        FREE(this);
+        return NULL;
+    }
+    return this;
+}
+
+unsigned long long METHOD_IMPL(bytes, int direction)
+{
+    return this->flows[direction == RELAY_A_TO_B ? 0 : 1].bytes;
+}
+
+void METHOD_IMPL(deconstruct)
+{
+    release_ends(this);
+}
+
+VIRTUAL(Object)
+    VMETHOD_BASE(Object, construct);
+    VMETHOD_BASE(Object, deconstruct);
+
+    VMETHOD(bytes);
+
+    VFIELD(splicing) = 0;
+    VFIELD(finished) = 0;
+    VFIELD(error) = 0;
+END_VIRTUAL
+#undef CLASS_NAME
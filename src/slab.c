@@ -0,0 +1,134 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+#include "debug.h"
+
+struct slab
+{
+    /* on the cache's partial or full list. First, so the lists can be
+     * freed straight from */
+    struct list_head list;
+    struct slab_cache *cache;
+    /* free objects are chained through their first word */
+    void *free;
+    unsigned int used;
+    unsigned int capacity;
+};
+
+#define SLAB_HEADER \
+    ((sizeof(struct slab) + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1))
+#define NEXT(obj) (*(void**)(obj))
+
+void slab_cache_init(struct slab_cache *cache, size_t size)
+{
+    if(size < sizeof(void*))
+        size = sizeof(void*);
+    /* anything a cache line or bigger gets whole lines, so it never
+     * straddles more of them than it has to */
+    if(size >= SLAB_CACHE_LINE)
+        cache->size = (size + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+    else
+        cache->size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    ASSERT(cache->size <= SLAB_SIZE - SLAB_HEADER);
+    INIT_LIST_HEAD(&cache->partial);
+    INIT_LIST_HEAD(&cache->full);
+    cache->empty = 0;
+    cache->slabs = 0;
+    cache->used = 0;
+}
+
+static struct slab *slab_new(struct slab_cache *cache)
+{
+    struct slab *slab = (struct slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if(!slab)
+        return NULL;
+    slab->cache = cache;
+    slab->used = 0;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER) / cache->size;
+    /* handed out lowest address first */
+    slab->free = NULL;
+    char *obj = (char*)slab + SLAB_HEADER + (slab->capacity - 1) * cache->size;
+    for(;obj >= (char*)slab + SLAB_HEADER;obj -= cache->size)
+    {
+        NEXT(obj) = slab->free;
+        slab->free = obj;
+    }
+    list_add(&slab->list, &cache->partial);
+    cache->slabs++;
+    cache->empty++;
+    return slab;
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+#ifdef SLAB_MALLOC
+    /* still listed, so destroying the cache frees what's left */
+    struct list_head *head =
+        (struct list_head*)malloc(sizeof(struct list_head) + cache->size);
+    if(!head)
+        return NULL;
+    list_add(head, &cache->full);
+    return head + 1;
+#else
+    struct slab *slab;
+    if(list_empty(&cache->partial))
+    {
+        if(!(slab = slab_new(cache)))
+            return NULL;
+    }
+    else
+        slab = list_first(struct slab, &cache->partial, list);
+
+    void *obj = slab->free;
+    slab->free = NEXT(obj);
+    if(slab->used++ == 0)
+        cache->empty--;
+    if(slab->used == slab->capacity)
+        list_move(&slab->list, &cache->full);
+    cache->used++;
+    return obj;
+#endif
+}
+
+void slab_free(void *obj)
+{
+#ifdef SLAB_MALLOC
+    struct list_head *head = (struct list_head*)obj - 1;
+    list_del(head);
+    free(head);
+#else
+    struct slab *slab = (struct slab*)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+    struct slab_cache *cache = slab->cache;
+    NEXT(obj) = slab->free;
+    slab->free = obj;
+    cache->used--;
+    if(slab->used-- == slab->capacity)
+        list_move(&slab->list, &cache->partial);
+    if(slab->used)
+        return;
+    if(cache->empty >= SLAB_KEEP_EMPTY)
+    {
+        list_del(&slab->list);
+        cache->slabs--;
+        free(slab);
+        return;
+    }
+    cache->empty++;
+#endif
+}
+
+void slab_cache_destroy(struct slab_cache *cache)
+{
+    struct list_head *i, *j;
+    list_for_each_safe(i, j, &cache->partial)
+        free(i);
+    list_for_each_safe(i, j, &cache->full)
+        free(i);
+    INIT_LIST_HEAD(&cache->partial);
+    INIT_LIST_HEAD(&cache->full);
+    cache->empty = 0;
+    cache->slabs = 0;
+    cache->used = 0;
+}
@@ -1,53 +1,303 @@
-
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/in.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
 
 #include "debug.h"
 #include "sockets.h"
 #include "eventmanager.h"
 #include "buffermanager.h"
 
-#define SOCKET_BUFFER_SIZE      (16*1024)
 #define SOCKET_DEFAULT_MAX_MEM  (1024*1024)
+/* most buffers handed to the kernel in one sendmsg */
+#define SOCKET_IOV_MAX          IOV_MAX
+/* and in one the loop sends (submit_io), which has to keep them */
+#define SOCKET_SEND_IOV         64
+/* receive sizing: reads start at SOCKET_RECV_MIN and double each time
+ * they fill what they're offered, up to SOCKET_RECV_MAX spread across
+ * at most SOCKET_READ_IOV buffers. SOCKET_RECV_SHRINK_AFTER reads in a
+ * row that use less than a quarter halve it again */
+#define SOCKET_RECV_MIN         (2*1024)
+#define SOCKET_RECV_MAX         (256*1024)
+#define SOCKET_READ_IOV         (SOCKET_RECV_MAX / SOCKET_BUFFER_SIZE)
+#define SOCKET_RECV_SHRINK_AFTER 4
+/* how often a socket throttled by memory pressure checks again (ms) */
+#define SOCKET_THROTTLE_RETRY   10
+
+/* how long data may wait when a socket only delivers in batches and
+ * didn't say (us) */
+#define SOCKET_DEFAULT_DELIVER_DELAY    100000
+
+/* Sockets kept ready before the first connection arrives */
+#define SOCKET_POOL_PREALLOC    256
+
+/* sockets never move between loops, so each thread tracks its own */
+static __thread struct list_head sockets;
+/* delivery counters for every socket on this thread */
+static __thread struct socket_delivery_stats thread_delivery;
+/* zerocopy pins left behind by sockets that were closed before the
+ * kernel said it was done with them. There's no way to find out once
+ * the fd is gone, so they're let go of after SOCKET_ZEROCOPY_LINGER us,
+ * long after the data will have been sent or the connection reset */
+static __thread struct list_head zerocopy_orphans;
+#define SOCKET_ZEROCOPY_LINGER  (10*1000000)
+
+/* ms a Listener waits before accepting again after running out of fds */
+#define LISTENER_RETRY          100
+
+/* the buffers behind one MSG_ZEROCOPY send. The kernel numbers sends
+ * from 0 and reports them done in ranges on the error queue */
+struct zerocopy_pin
+{
+    struct list_head list;
+    uint32_t seq;
+    struct list_head buffers;
+    /* when the socket was closed, for orphans */
+    long long orphaned;
+};
+
+/* a sendmsg the loop has in flight. The kernel reads from the write
+ * queue until it completes, so a socket freed before then leaves its
+ * queue here */
+struct socket_send
+{
+    struct event_send req;
+    /* NULL once the socket is gone */
+    Socket socket;
+    MemStringIO queue;
+    char busy;
+    char zerocopy;
+    struct iovec iov[SOCKET_SEND_IOV];
+};
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void count_delivery(struct socket_delivery_stats *stats,
+        long long waited)
+{
+    stats->deliveries++;
+    stats->total_us += waited;
+    if(waited > stats->max_us)
+        stats->max_us = waited;
+}
+
+/* a queue only exists while there's something in it, an idle socket
+ * holds on to nothing but itself */
+static MemStringIO queue_get(MemStringIO *queue)
+{
+    if(!*queue)
+        *queue = NEW(MemStringIO);
+    return *queue;
+}
+
+static size_t queued(MemStringIO queue)
+{
+    return queue ? queue->total_size : 0;
+}
+
+static void queue_release(MemStringIO *queue)
+{
+    if(*queue && (*queue)->total_size == 0)
+        DELETE(*queue);
+}
+
+/* queues are read from the front and written at the back */
+static size_t queue_read(MemStringIO queue, void *buf, size_t len)
+{
+    StringIO q = (StringIO)queue;
+    CALL(q, seek, 0, SEEK_SET);
+    len = CALL(q, read, buf, len);
+    size_t total_len = CALL(q, seek, 0, SEEK_END);
+    CALL(q, rtruncate, total_len - len);
+    return len;
+}
+
+static buffer *queue_read_buffer(MemStringIO queue)
+{
+    StringIO q = (StringIO)queue;
+    CALL(q, seek, 0, SEEK_SET);
+    buffer *b = CALL(q, read_buffer);
+    if(b)
+    {
+        size_t total_len = CALL(q, seek, 0, SEEK_END);
+        CALL(q, rtruncate, total_len - b->used);
+    }
+    return b;
+}
+
+static size_t queue_write(MemStringIO queue, void *buf, size_t len)
+{
+    CALL((StringIO)queue, seek, 0, SEEK_END);
+    return CALL((StringIO)queue, write, buf, len);
+}
+
+static int queue_write_buffer(MemStringIO queue, buffer *b)
+{
+    CALL((StringIO)queue, seek, 0, SEEK_END);
+    return CALL((StringIO)queue, write_buffer, b);
+}
+
+/* hands whatever has been read to the consumer */
+static void deliver(Socket this)
+{
+    if(this->pending_since)
+    {
+        long long waited = now_us() - this->pending_since;
+        count_delivery(&this->delivery, waited);
+        count_delivery(&thread_delivery, waited);
+        this->pending_since = 0;
+        this->undelivered = 0;
+    }
+    this->info.data_available(this);
+}
+
+static void pause_reading(Socket this, int reason)
+{
+    if(!this->read_paused && !this->flag_eof)
+        event_modify(this->event, EV_REMOVE | EV_READ);
+    this->read_paused |= reason;
+}
 
-static LIST_HEAD(sockets);
+static void resume_reading(Socket this, int reason)
+{
+    if(!(this->read_paused & reason))
+        return;
+    this->read_paused &= ~reason;
+    if(!this->read_paused && !this->flag_eof)
+        event_modify(this->event, EV_ADD | EV_READ);
+}
+
+/* called whenever the consumer takes data out of the read queue */
+static void read_drained(Socket this)
+{
+    if(queued(this->read_queue) <= this->mem_low)
+        resume_reading(this, SOCKET_PAUSE_BUFFERED);
+    queue_release(&this->read_queue);
+}
+
+/* the peer has closed its side. With submit_io that can come while
+ * reading is paused, with data still queued for the consumer */
+static void read_eof(Socket this, event e)
+{
+    this->flag_eof = 1;
+    if(this->write_closed && !queued(this->read_queue))
+        DELETE(this);
+    else
+    {
+        deliver(this);
+        event_modify(e, EV_REMOVE | EV_READ);
+    }
+}
+
+/* 'count' bytes have been added to the read queue. Returns 0 if that
+ * paused reading */
+static char count_read(Socket this, event e, size_t count)
+{
+    long long now = now_us();
+    if(!this->pending_since)
+        this->pending_since = now;
+    this->undelivered += count;
+
+    if(queued(this->read_queue) >= this->mem_high)
+    {
+        /* reading resumes once the consumer has caught up */
+        pause_reading(this, SOCKET_PAUSE_BUFFERED);
+        deliver(this);
+        return 0;
+    }
+
+    /* deliver on whichever of the size or the deadline comes first */
+    long long waited = now - this->pending_since;
+    if(this->undelivered >= this->deliver_bytes ||
+            waited >= this->deliver_delay)
+        deliver(this);
+    else if(waited == 0)
+        event_alarm(e, (this->deliver_delay + 999) / 1000);
+    return 1;
+}
 
 static int read_callback(event e, struct event_info *info)
 {
     Socket this = (Socket)info->context;
-    CALL((StringIO)this->__read_buffers, seek, 0, SEEK_END);
-    buffer *b = CALL(this->__read_buffers, get_current_buffer);
-    char new_buffer = 0;
-    /* check to see if our current buffer has space left */
-    if(b == NULL)
+    if(buffer_memory_pressure())
+    {
+        /* leave the data in the kernel until the process has drained */
+        pause_reading(this, SOCKET_PAUSE_PRESSURE);
+        event_alarm(e, SOCKET_THROTTLE_RETRY);
+        if(queued(this->read_queue))
+            deliver(this);
+        return EV_DONE;
+    }
+
+    /* carry on filling the last buffer if nothing else holds it */
+    buffer *tail = NULL;
+    if(this->read_queue)
+    {
+        CALL((StringIO)this->read_queue, seek, 0, SEEK_END);
+        tail = this->read_queue->current_buf;
+        if(tail && (tail->used == tail->size || tail->orig->ref_count > 1))
+            tail = NULL;
+    }
+
+    struct iovec iov[SOCKET_READ_IOV];
+    buffer *fresh[SOCKET_READ_IOV];
+    int count = 0, fresh_count = 0;
+    size_t offered = 0;
+    if(tail)
+    {
+        iov[count].iov_base = (void*)((uintptr_t)tail->ptr + tail->used);
+        iov[count].iov_len = tail->size - tail->used;
+        offered += iov[count++].iov_len;
+    }
+    /* bulk connections get several buffers, so one call can take
+     * everything the kernel has */
+    while(offered < this->recv_size && count < SOCKET_READ_IOV)
     {
-        b = buffer_get(SOCKET_BUFFER_SIZE);
+        size_t want = this->recv_size - offered;
+        buffer *b = buffer_get(
+            want < SOCKET_BUFFER_SIZE ? want : SOCKET_BUFFER_SIZE);
         if(b == NULL)
-        {
-            DPRINTF("buffer_get gave us a NULL buffer\n");
-            DELETE(this);
-            return EV_DONE;
-        }
-        new_buffer = 1;
+            break;
+        fresh[fresh_count++] = b;
+        iov[count].iov_base = b->ptr;
+        iov[count].iov_len = b->size;
+        offered += iov[count++].iov_len;
+    }
+    if(count == 0)
+    {
+        DPRINTF("buffer_get gave us a NULL buffer\n");
+        DELETE(this);
+        return EV_DONE;
     }
 
-    int read_count = recv(
-        info->fd, 
-        (void*)((uintptr_t)b->ptr + b->pos),
-        b->size - b->pos, MSG_DONTWAIT);
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count,
+    };
+    ssize_t read_count = recvmsg(info->fd, &msg, MSG_DONTWAIT);
 
+    if(read_count <= 0)
+    {
+        int i;
+        for(i = 0;i < fresh_count;i++)
+            buffer_recycle(fresh[i]);
+    }
     if(read_count == -1)
     {
-        if(new_buffer)
-        {
-            buffer_recycle(b);
-            b = NULL;
-        }
         if(errno == EAGAIN || errno == EWOULDBLOCK)
             return EV_DONE;
         if(errno == EINTR)
@@ -59,72 +309,356 @@ static int read_callback(event e, struct event_info *info)
     }
     if(read_count == 0)
     {
-        if(new_buffer)
+        read_eof(this, e);
+        return EV_DONE;
+    }
+
+    /* hand out what was read in order, tail first */
+    size_t left = read_count;
+    if(tail)
+    {
+        size_t len = tail->size - tail->used;
+        if(len > left)
+            len = left;
+        CALL(this->read_queue, update_current_buffer, len);
+        left -= len;
+    }
+    int i;
+    for(i = 0;i < fresh_count;i++)
+    {
+        buffer *b = fresh[i];
+        if(left == 0)
         {
             buffer_recycle(b);
-            b = NULL;
-        }
-        /* EOF */
-        this->flag_eof = 1;
-        if(this->write_closed)
-            DELETE(this);
-        else
-        {
-            this->info.data_available(this);
-            event_modify(e, EV_REMOVE | EV_READ);
+            continue;
         }
-        return EV_DONE;
+        b->used = left < b->size ? left : b->size;
+        left -= b->used;
+        queue_write_buffer(queue_get(&this->read_queue), b);
     }
-    if(new_buffer)
+
+    /* grow while reads fill everything they're given, shrink back once
+     * they keep coming up well short */
+    char filled = read_count == offered;
+    if(filled)
     {
-        b->used += read_count;
-        ASSERT(b->used <= b->size);
-        CALL((StringIO)this->read_queue, write_buffer, b);
+        this->small_reads = 0;
+        if(this->recv_size < SOCKET_RECV_MAX)
+            this->recv_size *= 2;
+    }
+    else if(read_count < this->recv_size / 4)
+    {
+        if(++this->small_reads >= SOCKET_RECV_SHRINK_AFTER &&
+                this->recv_size > SOCKET_RECV_MIN)
+        {
+            this->recv_size /= 2;
+            this->small_reads = 0;
+        }
     }
     else
-        CALL(this->__read_buffers, update_current_buffer, read_count);
+        this->small_reads = 0;
 
-    /* actually give the buffer a chance to fill up */
-    if(b->used >= b->size)
-        this->info.data_available(this);
-    else
-        event_alarm(e, 100);
-    return EV_READ_PENDING;
+    return count_read(this, e, read_count) ? EV_READ_PENDING : EV_DONE;
 }
 
-static int write_callback(event e, struct event_info *info)
+/* submit_io: the loop read into 'b' */
+static void received_callback(event e, struct event_info *info, buffer *b,
+        int result)
 {
     Socket this = (Socket)info->context;
-    CALL((StringIO)this->__write_buffers, seek, 0, SEEK_SET);
-    buffer *b = CALL(this->__write_buffers, get_current_buffer);
+    if(result == 0)
+    {
+        read_eof(this, e);
+        return;
+    }
+    if(result == -ENOBUFS)
+    {
+        /* the loop has nothing left to read into */
+        pause_reading(this, SOCKET_PAUSE_PRESSURE);
+        event_alarm(e, SOCKET_THROTTLE_RETRY);
+        return;
+    }
+    if(result < 0)
+    {
+        DPRINTF("Error while reading: %s (%d)\n", strerror(-result), -result);
+        DELETE(this);
+        return;
+    }
+
+    queue_write_buffer(queue_get(&this->read_queue), b);
+    if(buffer_memory_pressure())
+    {
+        /* stop taking data off the kernel until the process has drained */
+        pause_reading(this, SOCKET_PAUSE_PRESSURE);
+        event_alarm(e, SOCKET_THROTTLE_RETRY);
+        deliver(this);
+        return;
+    }
+    count_read(this, e, result);
+}
 
-    if(b == NULL)
+/* holds a reference to every buffer the first 'len' bytes of the write
+ * queue came from, until the send is reported complete */
+static void zerocopy_pin(Socket this, size_t len)
+{
+    struct zerocopy_pin *pin =
+        (struct zerocopy_pin*)malloc(sizeof(struct zerocopy_pin));
+    uint32_t seq = this->zerocopy_seq++;
+    if(pin == NULL)
     {
-        event_modify(e, EV_REMOVE | EV_WRITE);
-        if(this->write_closed)
+        DPRINTF("unable to pin zerocopy send %u\n", seq);
+        return;
+    }
+    pin->seq = seq;
+    INIT_LIST_HEAD(&pin->buffers);
+    buffer *b;
+    list_for_each_entry(b, &this->write_queue->buffers, list)
+    {
+        if(len == 0)
+            break;
+        if(b->used == 0)
+            continue;
+        buffer *dup = buffer_dup(b);
+        if(dup)
+            list_add_tail(&dup->list, &pin->buffers);
+        len -= len < b->used ? len : b->used;
+    }
+    list_add_tail(&pin->list, &this->zerocopy_pending);
+    this->zerocopy_sends++;
+}
+
+static void zerocopy_unpin(struct zerocopy_pin *pin)
+{
+    buffer *b, *n;
+    list_for_each_entry_safe(b, n, &pin->buffers, list)
+    {
+        list_del(&b->list);
+        b->list.next = b->list.prev = NULL;
+        buffer_recycle(b);
+    }
+    list_del(&pin->list);
+    free(pin);
+}
+
+static void release_orphans(int all)
+{
+    if(zerocopy_orphans.next == NULL)
+        return;
+    long long now = now_us();
+    /* oldest at the head */
+    struct zerocopy_pin *pin, *n;
+    list_for_each_entry_safe(pin, n, &zerocopy_orphans, list)
+    {
+        if(!all && now - pin->orphaned < SOCKET_ZEROCOPY_LINGER)
+            break;
+        zerocopy_unpin(pin);
+    }
+}
+
+/* reaps completions from the error queue, unpinning sends first to last */
+static void zerocopy_complete(Socket this)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    while(1)
+    {
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        if(recvmsg(this->info.sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                DPRINTF("Error reading error queue: %s (%d)\n",
+                    strerror(errno), errno);
+            return;
+        }
+        struct cmsghdr *cm;
+        for(cm = CMSG_FIRSTHDR(&msg);cm;cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                    !(cm->cmsg_level == SOL_IPV6 &&
+                        cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *err =
+                (struct sock_extended_err*)CMSG_DATA(cm);
+            if(err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* sends ee_info to ee_data inclusive are done */
+            uint32_t first = err->ee_info;
+            uint32_t span = err->ee_data - first;
+            if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                this->zerocopy_copied += span + 1;
+
+            struct zerocopy_pin *pin, *n;
+            list_for_each_entry_safe(pin, n, &this->zerocopy_pending, list)
+            {
+                if((uint32_t)(pin->seq - first) > span)
+                    break;
+                zerocopy_unpin(pin);
+            }
+        }
+    }
+}
+
+/* everything queued has been sent */
+static int write_done(Socket this, event e)
+{
+    event_modify(e, EV_REMOVE | EV_WRITE);
+    queue_release(&this->write_queue);
+    /* only ever called with no send in flight */
+    free(this->send);
+    this->send = NULL;
+    if(this->write_closed)
+    {
+        int result = shutdown(this->info.sock_fd, SHUT_WR);
+        if(result == -1 && errno != ENOTCONN)
+            DPRINTF("Error sending EOF: %s (%d)\n", strerror(errno), errno);
+        if(this->flag_eof)
+            DELETE(this);
+    }
+    return EV_DONE;
+}
+
+static void send_done(struct event_send *req, int result);
+
+/* submit_io: the front of the write queue goes to the loop as one
+ * sendmsg, and what's left once that has completed */
+static int submit_write(Socket this, event e)
+{
+    struct socket_send *send = this->send;
+    if(send && send->busy)
+        return EV_DONE;
+    if(queued(this->write_queue) == 0)
+        return write_done(this, e);
+    if(!send)
+    {
+        send = (struct socket_send*)malloc(sizeof(struct socket_send));
+        if(send == NULL)
         {
-            int result = shutdown(info->fd, SHUT_WR);
-            if(result == -1 && errno != ENOTCONN)
-                DPRINTF("Error sending EOF: %s (%d)\n", strerror(errno), errno);
-            if(this->flag_eof)
-                DELETE(this);
+            DPRINTF("unable to allocate a send\n");
+            DELETE(this);
+            return EV_DONE;
         }
-        return EV_DONE;    
+        memset(send, '\0', sizeof(*send));
+        send->socket = this;
+        send->req.done = send_done;
+        this->send = send;
     }
 
-    int write_size = b->used - b->pos;
-    ASSERT(write_size > 0);
-    if(write_size == 0)
+    int count = CALL(this->write_queue, get_iovec, send->iov, SOCKET_SEND_IOV);
+    size_t write_size = 0;
+    int i;
+    for(i = 0;i < count;i++)
+        write_size += send->iov[i].iov_len;
+    memset(&send->req.msg, '\0', sizeof(send->req.msg));
+    send->req.msg.msg_iov = send->iov;
+    send->req.msg.msg_iovlen = count;
+    send->zerocopy = this->zerocopy_threshold &&
+        write_size >= this->zerocopy_threshold;
+    send->req.flags = send->zerocopy ?
+        MSG_NOSIGNAL | MSG_ZEROCOPY : MSG_NOSIGNAL;
+
+    int result = event_send(e, &send->req);
+    if(result != EVENTMGR_SUCCESS)
     {
+        DPRINTF("Failed to send: %s (%d)\n",
+            eventmanager_strerror(result), result);
         DELETE(this);
         return EV_DONE;
     }
+    send->busy = 1;
+    return EV_DONE;
+}
+
+static void send_done(struct event_send *req, int result)
+{
+    struct socket_send *send = (struct socket_send*)req;
+    Socket this = send->socket;
+    send->busy = 0;
+    if(!this)
+    {
+        if(send->queue)
+            DELETE(send->queue);
+        free(send);
+        return;
+    }
 
-    int result = send(
-            info->fd, 
-            (void*)((uintptr_t)b->ptr + b->pos), 
-            b->used - b->pos, 
-            MSG_DONTWAIT | MSG_NOSIGNAL);
+    event e = this->event;
+    if(result == -ENOBUFS && send->zerocopy)
+    {
+        /* out of optmem for pinning pages, copy this one */
+        send->zerocopy = 0;
+        send->req.flags &= ~MSG_ZEROCOPY;
+        if(event_send(e, req) == EVENTMGR_SUCCESS)
+            send->busy = 1;
+        else
+            DELETE(this);
+        return;
+    }
+    if(result == -EAGAIN || result == -EINTR)
+    {
+        submit_write(this, e);
+        return;
+    }
+    if(result < 0)
+    {
+        DPRINTF("Received error on send: %s (%d)\n",
+            strerror(-result), -result);
+        DELETE(this);
+        return;
+    }
+    if(send->zerocopy)
+        zerocopy_pin(this, result);
+
+    CALL((StringIO)this->write_queue, rtruncate,
+        this->write_queue->total_size - result);
+    if(this->write_full && this->write_queue->total_size <= this->mem_low)
+    {
+        this->write_full = 0;
+        if(this->info.write_drained)
+            this->info.write_drained(this);
+    }
+    /* io_uring waits for room itself, so a short send just means
+     * sending the rest */
+    submit_write(this, e);
+}
+
+static int write_callback(event e, struct event_info *info)
+{
+    Socket this = (Socket)info->context;
+    if(this->submit_io)
+        return submit_write(this, e);
+    /* the whole queue goes out in one call, however many buffers it's
+     * made of */
+    struct iovec iov[SOCKET_IOV_MAX];
+    int count = this->write_queue ?
+        CALL(this->write_queue, get_iovec, iov, SOCKET_IOV_MAX) : 0;
+    if(count == 0)
+        return write_done(this, e);
+
+    size_t write_size = 0;
+    int i;
+    for(i = 0;i < count;i++)
+        write_size += iov[i].iov_len;
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count,
+    };
+    /* big enough writes skip the copy into the kernel */
+    int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    char zerocopy = this->zerocopy_threshold &&
+        write_size >= this->zerocopy_threshold;
+    ssize_t result = sendmsg(info->fd, &msg,
+        zerocopy ? flags | MSG_ZEROCOPY : flags);
+    if(result == -1 && zerocopy && errno == ENOBUFS)
+    {
+        /* out of optmem for pinning pages, copy this one */
+        zerocopy = 0;
+        result = sendmsg(info->fd, &msg, flags);
+    }
 
     if(result == -1)
     {
@@ -137,22 +671,53 @@ static int write_callback(event e, struct event_info *info)
         DELETE(this);
         return EV_DONE;
     }
-    /* remove written data from start of stringio */
-    CALL((StringIO)this->__write_buffers, rtruncate,
-        this->__write_buffers->total_size - result);
+    /* the kernel reads straight out of the buffers until it's done */
+    if(zerocopy)
+        zerocopy_pin(this, result);
+
+    /* remove written data from start of stringio, however many buffers
+     * that spans */
+    CALL((StringIO)this->write_queue, rtruncate,
+        this->write_queue->total_size - result);
+    if(this->write_full && this->write_queue->total_size <= this->mem_low)
+    {
+        this->write_full = 0;
+        if(this->info.write_drained)
+            this->info.write_drained(this);
+    }
+    if(this->write_queue->total_size == 0)
+        return write_done(this, e);
+    /* a short write means the socket buffer is full, wait to be told
+     * there's room */
+    if(result < write_size)
+        return EV_DONE;
     return EV_WRITE_PENDING;
 }
 
 static int except_callback(event e, struct event_info *info)
 {
-    DPRINTF("Exception!\n");
+    Socket this = (Socket)info->context;
+    if(!list_empty(&this->zerocopy_pending))
+        zerocopy_complete(this);
+    else
+        DPRINTF("Exception!\n");
     return EV_DONE;
 }
 
 static int alarm_callback(event e, struct event_info *info)
 {
     Socket this = (Socket)info->context;
-    this->info.data_available(this);
+    if(this->read_paused & SOCKET_PAUSE_PRESSURE)
+    {
+        if(buffer_memory_pressure())
+        {
+            event_alarm(e, SOCKET_THROTTLE_RETRY);
+            return EV_DONE;
+        }
+        resume_reading(this, SOCKET_PAUSE_PRESSURE);
+    }
+    if(this->undelivered)
+        deliver(this);
     return EV_DONE;
 }
 
@@ -160,12 +725,24 @@ static int alarm_callback(event e, struct event_info *info)
 Socket METHOD_IMPL(construct, struct socket_info *info)
 {
     SUPER_CALL(Object, this, construct);
-    this->__read_buffers = NEW(MemStringIO);
-    this->__write_buffers = NEW(MemStringIO);
-    this->read_queue = NEW(Pipe, this->__read_buffers);
-    this->write_queue = NEW(Pipe, this->__write_buffers);
-
     this->info = *info;
+    this->mem_high = info->max_mem ? info->max_mem : SOCKET_DEFAULT_MAX_MEM;
+    this->mem_low = this->mem_high / 2;
+    CALL(this, set_delivery, info->deliver_bytes, info->deliver_delay);
+
+    INIT_LIST_HEAD(&this->zerocopy_pending);
+    this->zerocopy_threshold = info->zerocopy_threshold;
+    if(this->zerocopy_threshold)
+    {
+        int on = 1;
+        if(setsockopt(info->sock_fd, SOL_SOCKET, SO_ZEROCOPY,
+                    &on, sizeof(on)) == -1)
+        {
+            DPRINTF("SO_ZEROCOPY unavailable, copying: %s (%d)\n",
+                strerror(errno), errno);
+            this->zerocopy_threshold = 0;
+        }
+    }
 
     struct event_info event_info = {
         .fd = info->sock_fd,
@@ -175,33 +752,55 @@ Socket METHOD_IMPL(construct, struct socket_info *info)
         .write = write_callback,
         .except = except_callback,
         .alarm = alarm_callback,
+        .received = received_callback,
     };
+    /* the error queue is only of interest for zerocopy */
+    this->submit_io = eventmanager_submits_io(info->loop) != 0;
+    if(this->submit_io)
+        event_info.events = EV_SUBMIT | EV_READ |
+            (this->zerocopy_threshold ? EV_EXCEPT : 0);
 
-    int result = event_register(&event_info, &this->event);
+    int result = event_register(info->loop, &event_info, &this->event);
     if(result != EVENTMGR_SUCCESS)
     {
         DPRINTF("Failed to register event: %s (%d)\n",
             eventmanager_strerror(result), result);
-        free(this);
+        FREE(this);
         return NULL;
     }
+    if(sockets.next == NULL)
+        INIT_LIST_HEAD(&sockets);
     list_add(&this->list, &sockets);
     return this;
 }
 
 size_t METHOD_IMPL(read, void *buf, size_t size)
 {
-    return CALL((StringIO)this->read_queue, read, buf, size);
+    if(!this->read_queue)
+    {
+        errno = EAGAIN;
+        return 0;
+    }
+    size_t len = queue_read(this->read_queue, buf, size);
+    read_drained(this);
+    return len;
 }
 
 buffer *METHOD_IMPL(read_buffer)
 {
-    return CALL((StringIO)this->read_queue, read_buffer);
+    if(!this->read_queue)
+    {
+        errno = EAGAIN;
+        return NULL;
+    }
+    buffer *b = queue_read_buffer(this->read_queue);
+    read_drained(this);
+    return b;
 }
 
 char METHOD_IMPL(eof)
 {
-    if(CALL((StringIO)this->__read_buffers, seek, 0, SEEK_END) == 0)
+    if(queued(this->read_queue) == 0)
         return this->flag_eof;
     return 0;
 }
@@ -215,9 +814,11 @@ int METHOD_IMPL(write, void *buff, size_t size)
         errno = EPIPE;
         return -1;
     }
-    size_t len = CALL((StringIO)this->write_queue, write, buff, size);
+    size_t len = queue_write(queue_get(&this->write_queue), buff, size);
     if(len < 0)
         return -1;
+    if(this->write_queue->total_size >= this->mem_high)
+        this->write_full = 1;
     event_modify(this->event, EV_ADD | EV_WRITE);
     return 0;
 }
@@ -229,7 +830,9 @@ int METHOD_IMPL(write_buffer, buffer *b)
         errno = EPIPE;
         return -1;
     }
-    CALL((StringIO)this->write_queue, write_buffer, b);
+    queue_write_buffer(queue_get(&this->write_queue), b);
+    if(this->write_queue->total_size >= this->mem_high)
+        this->write_full = 1;
     event_modify(this->event, EV_ADD | EV_WRITE);
     return 0;
 }
@@ -241,6 +844,51 @@ void METHOD_IMPL(send_eof)
     event_modify(this->event, EV_ADD | EV_WRITE);
 }
 
+void METHOD_IMPL(pause_read)
+{
+    pause_reading(this, SOCKET_PAUSE_USER);
+}
+
+void METHOD_IMPL(resume_read)
+{
+    resume_reading(this, SOCKET_PAUSE_USER);
+}
+
+char METHOD_IMPL(writable)
+{
+    return !this->write_full;
+}
+
+size_t METHOD_IMPL(mem_used)
+{
+    return queued(this->read_queue) + queued(this->write_queue);
+}
+
+void METHOD_IMPL(set_delivery, size_t bytes, unsigned int delay_us)
+{
+    this->deliver_bytes = bytes;
+    if(bytes == 0)
+        this->deliver_delay = 0;
+    else
+        this->deliver_delay = delay_us ? delay_us : SOCKET_DEFAULT_DELIVER_DELAY;
+}
+
+int METHOD_IMPL(detach)
+{
+    if(queued(this->read_queue) || queued(this->write_queue) ||
+            this->write_closed || !list_empty(&this->zerocopy_pending) ||
+            this->submit_io)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    event_deregister(this->event);
+    this->event = NULL;
+    int fd = this->info.sock_fd;
+    this->info.sock_fd = -1;
+    return fd;
+}
+
 off_t METHOD_IMPL(seek, off_t offset, int whence)
 {
     errno = ESPIPE;
@@ -262,20 +910,54 @@ int METHOD_IMPL(rtruncate, size_t len)
 /* frees this socket with no regard to waiting data */
 void METHOD_IMPL(deconstruct)
 {
-    event_deregister(this->event);
+    if(this->event)
+        event_deregister(this->event);
     this->event = NULL;
 
-    DELETE(this->__read_buffers);
-    DELETE(this->__write_buffers);
-    DELETE(this->read_queue);
-    DELETE(this->write_queue);
+    if(this->send)
+    {
+        /* the kernel may still be reading from the write queue */
+        if(this->send->busy)
+        {
+            this->send->socket = NULL;
+            this->send->queue = this->write_queue;
+            this->write_queue = NULL;
+        }
+        else
+            free(this->send);
+        this->send = NULL;
+    }
+
+    if(this->read_queue)
+        DELETE(this->read_queue);
+    if(this->write_queue)
+        DELETE(this->write_queue);
 
-    int result = shutdown(this->info.sock_fd, SHUT_RDWR);
-    if(result == -1)
+    if(!list_empty(&this->zerocopy_pending))
     {
-        DPRINTF("Error shutting down socket: %s (%d)\n", strerror(errno), errno);
+        zerocopy_complete(this);
+        if(zerocopy_orphans.next == NULL)
+            INIT_LIST_HEAD(&zerocopy_orphans);
+        long long now = now_us();
+        struct zerocopy_pin *pin, *n;
+        list_for_each_entry_safe(pin, n, &this->zerocopy_pending, list)
+        {
+            pin->orphaned = now;
+            list_move_tail(&pin->list, &zerocopy_orphans);
+        }
+    }
+    release_orphans(0);
+
+    /* unless it was detached */
+    if(this->info.sock_fd != -1)
+    {
+        int result = shutdown(this->info.sock_fd, SHUT_RDWR);
+        if(result == -1)
+        {
+            DPRINTF("Error shutting down socket: %s (%d)\n", strerror(errno), errno);
+        }
+        close(this->info.sock_fd);
     }
-    close(this->info.sock_fd);
 
     this->info.on_free(this);
 
@@ -296,9 +978,15 @@ VIRTUAL(StringIO)
 
     VMETHOD(eof);
     VMETHOD(send_eof);
+    VMETHOD(pause_read);
+    VMETHOD(resume_read);
+    VMETHOD(writable);
+    VMETHOD(mem_used);
+    VMETHOD(set_delivery);
+    VMETHOD(detach);
+
+    VPOOL(SOCKET_POOL_PREALLOC, CLASS_POOL_THREAD_LOCAL);
 
-    VFIELD(__read_buffers) = NULL;
-    VFIELD(__write_buffers) = NULL;
     VFIELD(read_queue) = NULL;
     VFIELD(write_queue) = NULL;
 
@@ -306,6 +994,22 @@ VIRTUAL(StringIO)
 
     VFIELD(flag_eof) = 0;
     VFIELD(write_closed) = 0;
+    VFIELD(write_full) = 0;
+    VFIELD(submit_io) = 0;
+    VFIELD(send) = NULL;
+    VFIELD(read_paused) = 0;
+    VFIELD(mem_high) = SOCKET_DEFAULT_MAX_MEM;
+    VFIELD(mem_low) = SOCKET_DEFAULT_MAX_MEM / 2;
+    VFIELD(recv_size) = SOCKET_RECV_MIN;
+    VFIELD(small_reads) = 0;
+    VFIELD(deliver_bytes) = 0;
+    VFIELD(deliver_delay) = 0;
+    VFIELD(pending_since) = 0;
+    VFIELD(undelivered) = 0;
+    VFIELD(zerocopy_threshold) = 0;
+    VFIELD(zerocopy_seq) = 0;
+    VFIELD(zerocopy_sends) = 0;
+    VFIELD(zerocopy_copied) = 0;
 END_VIRTUAL
 #undef CLASS_NAME
 
@@ -315,6 +1019,8 @@ void socket_free_all()
 #ifdef __DEBUG__
     int count = 0;
 #endif
+    if(sockets.next == NULL)
+        return;
     list_for_each_entry_safe(i, j, &sockets, list)
     {
 #ifdef __DEBUG__
@@ -323,5 +1029,182 @@ void socket_free_all()
         DELETE(i);
     }
     DPRINTF("Freed %d sockets\n", count);
+
+    release_orphans(1);
+}
+
+static int listen_failed(int fd, const char *call)
+{
+    int saved_errno = errno;
+    DPRINTF("%s failed: %s (%d)\n", call, strerror(errno), errno);
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+int socket_listen_tcp(unsigned short port, int backlog)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+    {
+        DPRINTF("socket() failed: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+    int on = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+        return listen_failed(fd, "setsockopt(SO_REUSEADDR)");
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        return listen_failed(fd, "setsockopt(SO_REUSEPORT)");
+
+    struct sockaddr_in self = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr = { INADDR_ANY },
+    };
+    if(bind(fd, (const struct sockaddr*)&self, sizeof(self)) == -1)
+        return listen_failed(fd, "bind()");
+    if(listen(fd, backlog) == -1)
+        return listen_failed(fd, "listen()");
+    return fd;
+}
+
+void socket_get_delivery_stats(struct socket_delivery_stats *stats)
+{
+    *stats = thread_delivery;
+}
+
+/* makes a Socket for a connection that has just been accepted */
+static void take_connection(Listener this, int fd)
+{
+    struct socket_info sock_info = {
+        .sock_fd = fd,
+        .loop = this->info.loop,
+        .context = this->info.context,
+    };
+    if(this->info.on_accept(this, &sock_info) == -1)
+    {
+        close(fd);
+        return;
+    }
+    Socket s = NEW(Socket, &sock_info);
+    if(!s)
+    {
+        close(fd);
+        return;
+    }
+    /* with TCP_DEFER_ACCEPT the first data is usually already waiting.
+     * Nothing reads it here: an edge triggered epoll ADD and an io_uring
+     * poll both report a socket that is readable when they are armed,
+     * and with submit_io the loop has a receive pending for it already */
+    this->accepted++;
+}
+
+static int accept_callback(event e, struct event_info *info)
+{
+    Listener this = (Listener)info->context;
+    int i;
+    for(i = 0;i < this->batch;i++)
+    {
+        int fd = accept4(info->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return EV_DONE;
+            if(errno == ECONNABORTED || errno == EINTR)
+                continue;
+            DPRINTF("error accepting connection: %s (%d)\n", strerror(errno), errno);
+            /* the backlog is left alone until there might be room */
+            if(errno == EMFILE || errno == ENFILE ||
+                    errno == ENOBUFS || errno == ENOMEM)
+                event_alarm(e, LISTENER_RETRY);
+            return EV_DONE;
+        }
+        take_connection(this, fd);
+    }
+    /* there may be more, but everything else gets a turn first */
+    return EV_READ_PENDING;
 }
 
+/* EV_SUBMIT: the loop accepted a connection, or failed to */
+static void accepted_callback(event e, struct event_info *info, int fd)
+{
+    Listener this = (Listener)info->context;
+    if(fd >= 0)
+    {
+        take_connection(this, fd);
+        return;
+    }
+    /* the loop carries on accepting */
+    if(fd == -ECONNABORTED || fd == -EINTR || fd == -EAGAIN)
+        return;
+    DPRINTF("error accepting connection: %s (%d)\n", strerror(-fd), -fd);
+    /* the backlog is left alone until there might be room */
+    event_modify(e, EV_REMOVE | EV_READ);
+    event_alarm(e, LISTENER_RETRY);
+}
+
+static int accept_retry(event e, struct event_info *info)
+{
+    if(!(info->events & EV_SUBMIT))
+        return EV_READ_PENDING;
+    event_modify(e, EV_ADD | EV_READ);
+    return EV_DONE;
+}
+
+#define CLASS_NAME(a,b) a## Listener ##b
+Listener METHOD_IMPL(construct, struct listener_info *info)
+{
+    SUPER_CALL(Object, this, construct);
+    this->info = *info;
+    this->batch = info->batch ? info->batch : LISTENER_DEFAULT_BATCH;
+
+    this->fd = socket_listen_tcp(info->port,
+        info->backlog ? info->backlog : SOMAXCONN);
+    if(this->fd == -1)
+    {
+        FREE(this);
+        return NULL;
+    }
+    int defer = info->defer_accept ? info->defer_accept : LISTENER_DEFAULT_DEFER;
+    if(defer > 0 && setsockopt(this->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                &defer, sizeof(defer)) == -1)
+        DPRINTF("TCP_DEFER_ACCEPT unavailable: %s (%d)\n", strerror(errno), errno);
+
+    struct event_info event_info = {
+        .fd = this->fd,
+        .events = EV_READ | EV_EXCEPT,
+        .context = this,
+        .read = accept_callback,
+        .alarm = accept_retry,
+        .accepted = accepted_callback,
+    };
+    if(eventmanager_submits_io(info->loop))
+        event_info.events = EV_SUBMIT | EV_READ;
+    int result = event_register(info->loop, &event_info, &this->event);
+    if(result != EVENTMGR_SUCCESS)
+    {
+        DPRINTF("Failed to register listener: %s (%d)\n",
+            eventmanager_strerror(result), result);
+        close(this->fd);
+        FREE(this);
+        return NULL;
+    }
+    return this;
+}
+
+void METHOD_IMPL(deconstruct)
+{
+    event_deregister(this->event);
+    close(this->fd);
+}
+
+VIRTUAL(Object)
+    VMETHOD_BASE(Object, construct);
+    VMETHOD_BASE(Object, deconstruct);
+
+    VFIELD(fd) = -1;
+    VFIELD(event) = NULL;
+    VFIELD(batch) = LISTENER_DEFAULT_BATCH;
+    VFIELD(accepted) = 0;
+END_VIRTUAL
+#undef CLASS_NAME
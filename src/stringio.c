@@ -7,6 +7,9 @@
 #include "stringio.h"
 #include "debug.h"
 
+/* every busy socket has a queue or two */
+#define MEMSTRINGIO_POOL_PREALLOC 512
+
 #define CLASS_NAME(a,b) a## StringIO ##b
 VIRTUAL(Object)
 END_VIRTUAL
@@ -26,10 +29,11 @@ static buffer *METHOD_IMPL(get_buffer_at_pos, off_t *pos)
     return NULL;
 }
 
-static void METHOD_IMPL(construct)
+static MemStringIO METHOD_IMPL(construct)
 {
     SUPER_CALL(Object, this, construct);
     INIT_LIST_HEAD(&this->buffers);
+    return this;
 }
 
 static void METHOD_IMPL(deconstruct)
@@ -88,14 +92,24 @@ static size_t METHOD_IMPL(read, void *buf, size_t len)
 
 static size_t METHOD_IMPL(write, void *buf, size_t len)
 {
-    buffer *b = NULL;
-    /* test if we need a new buffer */
     size_t written = 0;
     while(len > 0)
     {
-        if(!this->current_buf ||
-            this->current_buf->pos == this->current_buf->used)
+        buffer *b = this->current_buf;
+        if(b && b->pos == b->used && b->list.next != &this->buffers)
+        {
+            /* at the end of this buffer, carry on in the next one */
+            b = list_entry(b->list.next, buffer, list);
+            b->pos = 0;
+            this->current_buf = b;
+            continue;
+        }
+
+        /* other references to a buffer mustn't see this write */
+        char shared = b && b->orig->ref_count > 1;
+        if(!b || (b->pos == b->used && (b->used == b->size || shared)))
         {
+            /* at the end of the stream, with no room left to append */
             b = buffer_get(this->new_buffer_size);
             if(!b)
             {
@@ -105,11 +119,26 @@ static size_t METHOD_IMPL(write, void *buf, size_t len)
             list_add_tail(&b->list, &this->buffers);
             this->current_buf = b;
         }
-        else
-            b = this->current_buf;
+        else if(shared)
+        {
+            struct list_head *prev = b->list.prev;
+            off_t pos = b->pos;
+            list_del(&b->list);
+            b->list.next = b->list.prev = NULL;
+            buffer *w = buffer_make_writable(b);
+            if(!w)
+            {
+                list_add(&b->list, prev);
+                errno = ENOMEM;
+                return -1;
+            }
+            list_add(&w->list, prev);
+            w->pos = pos;
+            b = this->current_buf = w;
+        }
 
         size_t avail;
-        if(b == list_tail(buffer, &this->buffers, list))
+        if(b->list.next == &this->buffers)
             avail = b->size - b->pos;
         else
             avail = b->used - b->pos;
@@ -122,9 +151,13 @@ static size_t METHOD_IMPL(write, void *buf, size_t len)
             avail
         );
         len -= avail;
+        written += avail;
         b->pos += avail;
         if(b->pos > b->used)
-            b->pos = b->used;
+        {
+            this->total_size += b->pos - b->used;
+            b->used = b->pos;
+        }
         *(uintptr_t*)&buf += avail;
     }
     this->current_pos += written;
@@ -508,6 +541,23 @@ void METHOD_IMPL(update_current_buffer, size_t len)
     this->current_buf = w;
 }
 
+int METHOD_IMPL(get_iovec, struct iovec *iov, int count)
+{
+    int n = 0;
+    buffer *b;
+    list_for_each_entry(b, &this->buffers, list)
+    {
+        if(n == count)
+            break;
+        if(b->used == 0)
+            continue;
+        iov[n].iov_base = b->ptr;
+        iov[n].iov_len = b->used;
+        n++;
+    }
+    return n;
+}
+
 VIRTUAL(StringIO)
     VMETHOD_BASE(Object, construct);
     VMETHOD_BASE(Object, deconstruct);
@@ -521,6 +571,9 @@ VIRTUAL(StringIO)
 
     VMETHOD(get_current_buffer);
     VMETHOD(update_current_buffer);
+    VMETHOD(get_iovec);
+
+    VPOOL(MEMSTRINGIO_POOL_PREALLOC, CLASS_POOL_THREAD_LOCAL);
 
     VFIELD(current_buf) = NULL;
     VFIELD(current_pos) = 0;
@@ -528,76 +581,3 @@ VIRTUAL(StringIO)
     VFIELD(new_buffer_size) = 4096;
 END_VIRTUAL
 #undef CLASS_NAME // MemStringIO
-
-#define CLASS_NAME(a,b) a## Pipe ##b
-static Pipe METHOD_IMPL(construct, StringIO base)
-{
-    SUPER_CALL(Object, this, construct);
-    this->base = base;
-    return this;
-}
-
-static size_t METHOD_IMPL(read, void *buf, size_t len)
-{
-    CALL(this->base, seek, 0, SEEK_SET);
-    len = CALL(this->base, read, buf, len);
-    size_t total_len = CALL(this->base, seek, 0, SEEK_END);
-    CALL(this->base, rtruncate, total_len - len);
-    return len;
-}
-
-static size_t METHOD_IMPL(write, void *buf, size_t len)
-{
-    CALL(this->base, seek, 0, SEEK_END);
-    return CALL(this->base, write, buf, len);
-}
-
-static buffer *METHOD_IMPL(read_buffer)
-{
-    CALL(this->base, seek, 0, SEEK_SET);
-    buffer *b = CALL(this->base, read_buffer);
-    if(b)
-    {
-        size_t total_len = CALL(this->base, seek, 0, SEEK_END);
-        CALL(this->base, rtruncate, total_len - b->used);
-    }
-    return b;
-}
-
-static int METHOD_IMPL(write_buffer, buffer *b)
-{
-    CALL(this->base, seek, 0, SEEK_END);
-    return CALL(this->base, write_buffer, b);
-}
-
-static off_t METHOD_IMPL(seek, off_t offset, int whence)
-{
-    errno = ESPIPE;
-    return -1;
-}
-
-static int METHOD_IMPL(truncate, size_t len)
-{
-    errno = EINVAL;
-    return -1;
-}
-
-static int METHOD_IMPL(rtruncate, size_t len)
-{
-    errno = EINVAL;
-    return -1;
-}
-
-VIRTUAL(StringIO)
-    VMETHOD_BASE(Object, construct);
-    VMETHOD_BASE(StringIO, read);
-    VMETHOD_BASE(StringIO, write);
-    VMETHOD_BASE(StringIO, read_buffer);
-    VMETHOD_BASE(StringIO, write_buffer);
-    VMETHOD_BASE(StringIO, seek);
-    VMETHOD_BASE(StringIO, truncate);
-    VMETHOD_BASE(StringIO, rtruncate);
-
-    VFIELD(base) = NULL;
-END_VIRTUAL
-#undef CLASS_NAME // Pipe
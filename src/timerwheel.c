@@ -0,0 +1,217 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "class.h"
+#include "timerwheel.h"
+#include "debug.h"
+
+#define SLOT_MASK       (TIMERWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(l)  ((l) * TIMERWHEEL_SLOT_BITS)
+/* furthest a timer can be filed from 'current' */
+#define MAX_DELTA       ((1LL << LEVEL_SHIFT(TIMERWHEEL_LEVELS)) - 1)
+
+#define CLASS_NAME(a,b) a## TimerWheel ##b
+static TimerWheel METHOD_IMPL(construct, long long now)
+{
+    SUPER_CALL(Object, this, construct);
+    this->current = now;
+    this->count = 0;
+    INIT_LIST_HEAD(&this->expired);
+    int l, i;
+    for(l = 0;l < TIMERWHEEL_LEVELS;l++)
+    {
+        this->occupied[l] = 0;
+        for(i = 0;i < TIMERWHEEL_SLOTS;i++)
+            INIT_LIST_HEAD(&this->slots[l][i]);
+    }
+    return this;
+}
+
+static void METHOD_IMPL(file, struct timer_node *timer)
+{
+    long long delta = timer->expires - this->current;
+    if(delta < 0)
+    {
+        timer->slot = -1;
+        list_add_tail(&timer->list, &this->expired);
+        return;
+    }
+    /* anything past the last level is filed as far out as it goes and
+     * re-filed when that slot cascades */
+    long long expires = timer->expires;
+    if(delta > MAX_DELTA)
+    {
+        delta = MAX_DELTA;
+        expires = this->current + MAX_DELTA;
+    }
+
+    int level = 0;
+    while(level < TIMERWHEEL_LEVELS - 1 &&
+            delta >= (1LL << LEVEL_SHIFT(level + 1)))
+        level++;
+    int index = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+    timer->slot = level * TIMERWHEEL_SLOTS + index;
+    list_add_tail(&timer->list, &this->slots[level][index]);
+    this->occupied[level] |= 1ULL << index;
+}
+
+static void METHOD_IMPL(cancel, struct timer_node *timer)
+{
+    if(timer->ctxt != this)
+        return;
+    list_del(&timer->list);
+    if(timer->slot >= 0)
+    {
+        int level = timer->slot / TIMERWHEEL_SLOTS;
+        int index = timer->slot & SLOT_MASK;
+        if(list_empty(&this->slots[level][index]))
+            this->occupied[level] &= ~(1ULL << index);
+    }
+    timer->ctxt = NULL;
+    this->count--;
+}
+
+static void METHOD_IMPL(arm, struct timer_node *timer, long long expires)
+{
+    if(timer->ctxt == this)
+        CALL(this, cancel, timer);
+    ASSERT(timer->ctxt == NULL);
+    timer->expires = expires;
+    timer->ctxt = this;
+    this->count++;
+    PRIV_CALL(this, file, timer);
+}
+
+/* moves everything in the current slot of 'level' down a level,
+ * cascading the level above first when it has wrapped as well */
+static void METHOD_IMPL(cascade, int level)
+{
+    int index = (this->current >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    if(index == 0 && level + 1 < TIMERWHEEL_LEVELS)
+        PRIV_CALL(this, cascade, level + 1);
+
+    if(!(this->occupied[level] & (1ULL << index)))
+        return;
+    this->occupied[level] &= ~(1ULL << index);
+
+    struct list_head pending;
+    INIT_LIST_HEAD(&pending);
+    list_splice_init(&this->slots[level][index], &pending);
+
+    struct timer_node *i, *j;
+    list_for_each_entry_safe(i, j, &pending, list)
+    {
+        list_del(&i->list);
+        PRIV_CALL(this, file, i);
+    }
+}
+
+/* processes every millisecond up to and including 'now', moving due
+ * timers onto the expired list. Empty stretches of level 0 are skipped
+ * in one step, so a tick costs at most one iteration per occupied slot
+ * plus one per 64ms boundary crossed */
+static void METHOD_IMPL(advance, long long now)
+{
+    uint64_t filed = 0;
+    int l;
+    for(l = 0;l < TIMERWHEEL_LEVELS;l++)
+        filed |= this->occupied[l];
+    if(!filed)
+    {
+        /* nothing is waiting in the wheel, so there's nothing to walk */
+        if(this->current <= now)
+            this->current = now + 1;
+        return;
+    }
+
+    while(this->current <= now)
+    {
+        int index = this->current & SLOT_MASK;
+        if(index == 0)
+            PRIV_CALL(this, cascade, 1);
+
+        if(this->occupied[0] & (1ULL << index))
+        {
+            this->occupied[0] &= ~(1ULL << index);
+            struct timer_node *i;
+            list_for_each_entry(i, &this->slots[0][index], list)
+                i->slot = -1;
+            list_splice_init(&this->slots[0][index], this->expired.prev);
+        }
+
+        /* skip to the next occupied slot or the next boundary */
+        index++;
+        uint64_t rest = index < TIMERWHEEL_SLOTS ?
+            this->occupied[0] >> index : 0;
+        long long next;
+        if(rest)
+            next = this->current + 1 + __builtin_ctzll(rest);
+        else
+            next = (this->current | SLOT_MASK) + 1;
+        if(next > now + 1)
+            next = now + 1;
+        this->current = next;
+    }
+}
+
+static struct timer_node *METHOD_IMPL(expire, long long now)
+{
+    if(list_empty(&this->expired))
+    {
+        if(now < this->current)
+            return NULL;
+        PRIV_CALL(this, advance, now);
+        if(list_empty(&this->expired))
+            return NULL;
+    }
+    struct timer_node *timer =
+        list_first(struct timer_node, &this->expired, list);
+    list_del(&timer->list);
+    timer->ctxt = NULL;
+    this->count--;
+    return timer;
+}
+
+static long long METHOD_IMPL(next_expiry)
+{
+    if(this->count == 0)
+        return -1;
+    if(!list_empty(&this->expired))
+        return this->current - 1;
+
+    /* the upper levels are at least one cascade away. 'current' may
+     * itself be a boundary that hasn't cascaded yet */
+    long long boundary = (this->current + SLOT_MASK) & ~(long long)SLOT_MASK;
+    int l;
+    for(l = 1;l < TIMERWHEEL_LEVELS;l++)
+    {
+        if(this->occupied[l])
+            break;
+    }
+    long long next = l < TIMERWHEEL_LEVELS ? boundary : -1;
+
+    /* slots before 'index' belong to the next lap of level 0 */
+    int index = this->current & SLOT_MASK;
+    uint64_t rest = this->occupied[0] >> index;
+    long long level0 = -1;
+    if(rest)
+        level0 = this->current + __builtin_ctzll(rest);
+    else if(this->occupied[0])
+        level0 = (this->current | SLOT_MASK) + 1 +
+            __builtin_ctzll(this->occupied[0]);
+
+    if(next == -1 || (level0 != -1 && level0 < next))
+        next = level0;
+    return next;
+}
+
+VIRTUAL(Object)
+    VMETHOD_BASE(Object, construct);
+    VMETHOD(arm);
+    VMETHOD(cancel);
+    VMETHOD(expire);
+    VMETHOD(next_expiry);
+END_VIRTUAL
+#undef CLASS_NAME // TimerWheel
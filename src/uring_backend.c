@@ -0,0 +1,624 @@
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "eventbackend.h"
+#include "buffermanager.h"
+#include "debug.h"
+
+/* Every fd gets a multishot poll request, except EV_SUBMIT ones: they
+ * get a multishot receive, picking buffers from a ring the loop keeps
+ * filled, or a multishot accept, and their sends are sendmsg requests.
+ * Registering, modifying and removing them only fills in submission
+ * queue entries; everything queued since the last tick is handed to
+ * the kernel by the same io_uring_enter call that waits for
+ * completions. */
+
+#define URING_ENTRIES   256
+
+/* buffers receives can pick from, a power of two */
+#define URING_RECV_BUFFERS      256
+#define URING_RECV_BUFFER_SIZE  (16*1024)
+#define URING_RECV_GROUP        0
+
+/* what a request is, in the low bits of its user_data. Events come from
+ * a slab and sends from malloc, so they're aligned well enough */
+#define URING_POLL      0
+/* a receive or an accept */
+#define URING_SUBMIT    1
+#define URING_SEND      2
+#define URING_TAG_MASK  3
+
+struct uring
+{
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_len;
+    size_t sqes_len;
+
+    /* NULL if the kernel can't do receives this way, and then
+     * EV_SUBMIT isn't offered */
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    /* what's in the ring, by buffer id */
+    buffer *buffers[URING_RECV_BUFFERS];
+    unsigned buffers_queued;
+    /* ids that couldn't be given a new buffer yet */
+    unsigned short missing[URING_RECV_BUFFERS];
+    unsigned missing_count;
+};
+
+static inline int sys_io_uring_setup(unsigned entries,
+        struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit,
+        unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, arg, argsz);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline unsigned sq_queued(struct uring *r)
+{
+    return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int uring_submit(eventloop loop)
+{
+    struct uring *r = (struct uring*)loop->backend_data;
+    unsigned queued = sq_queued(r);
+    if(queued == 0)
+        return EVENTMGR_SUCCESS;
+    if(sys_io_uring_enter(loop->fd, queued, 0, 0, NULL, 0) == -1 &&
+            errno != EINTR && errno != EBUSY)
+    {
+        DPRINTF("io_uring_enter failed: %s (%d)\n", strerror(errno), errno);
+        return EVENTMGR_URING_ENTER_FAILED;
+    }
+    return EVENTMGR_SUCCESS;
+}
+
+/* there is no SQPOLL thread, so the kernel only looks at the
+ * submission queue during io_uring_enter and it's safe to publish the
+ * tail before the entry is filled in */
+static struct io_uring_sqe *uring_get_sqe(eventloop loop)
+{
+    struct uring *r = (struct uring*)loop->backend_data;
+    if(sq_queued(r) >= r->sq_entries)
+    {
+        if(uring_submit(loop) != EVENTMGR_SUCCESS)
+            return NULL;
+        if(sq_queued(r) >= r->sq_entries)
+            return NULL;
+    }
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, '\0', sizeof(*sqe));
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* puts a fresh buffer in the ring under 'bid', or remembers to try
+ * again. The kernel only sees it once the tail is published */
+static void buf_ring_add(struct uring *r, unsigned short bid)
+{
+    buffer *b = buffer_get(URING_RECV_BUFFER_SIZE);
+    if(b == NULL)
+    {
+        r->missing[r->missing_count++] = bid;
+        return;
+    }
+    struct io_uring_buf *slot =
+        &r->buf_ring->bufs[r->buf_tail & (URING_RECV_BUFFERS - 1)];
+    slot->addr = (uintptr_t)b->ptr;
+    slot->len = b->size;
+    slot->bid = bid;
+    r->buf_tail++;
+    r->buffers[bid] = b;
+    r->buffers_queued++;
+}
+
+static void buf_ring_publish(struct uring *r)
+{
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* hands over the buffer a receive was given, replacing it in the ring */
+static buffer *buf_ring_take(struct uring *r, unsigned short bid)
+{
+    buffer *b = r->buffers[bid];
+    r->buffers[bid] = NULL;
+    r->buffers_queued--;
+    buf_ring_add(r, bid);
+    buf_ring_publish(r);
+    return b;
+}
+
+static void buf_ring_refill(struct uring *r)
+{
+    unsigned count = r->missing_count;
+    r->missing_count = 0;
+    while(count--)
+        buf_ring_add(r, r->missing[count]);
+    buf_ring_publish(r);
+}
+
+/* multishot receives arrived in 5.19 with buffer rings, and are the
+ * only way to have a receive pending on every socket without a buffer
+ * set aside for each. Without them the loop sticks to polls */
+static void buf_ring_init(eventloop loop, struct uring *r)
+{
+    r->buf_ring = NULL;
+    r->missing_count = 0;
+    r->buffers_queued = 0;
+    r->buf_tail = 0;
+    memset(r->buffers, '\0', sizeof(r->buffers));
+
+    size_t len = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED)
+    {
+        DPRINTF("mmap of buffer ring failed: %s (%d)\n",
+            strerror(errno), errno);
+        return;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, '\0', sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_RECV_GROUP;
+    if(sys_io_uring_register(loop->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1)
+    {
+        DPRINTF("io_uring buffer ring unavailable, polling sockets: "
+            "%s (%d)\n", strerror(errno), errno);
+        munmap(ring, len);
+        return;
+    }
+    r->buf_ring = (struct io_uring_buf_ring*)ring;
+    unsigned short bid;
+    for(bid = 0;bid < URING_RECV_BUFFERS;bid++)
+        buf_ring_add(r, bid);
+    buf_ring_publish(r);
+    loop->submits_io = 1;
+}
+
+static void buf_ring_cleanup(struct uring *r)
+{
+    if(r->buf_ring == NULL)
+        return;
+    unsigned i;
+    for(i = 0;i < URING_RECV_BUFFERS;i++)
+    {
+        if(r->buffers[i])
+            buffer_recycle(r->buffers[i]);
+    }
+    munmap(r->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    r->buf_ring = NULL;
+}
+
+static int uring_init(eventloop loop)
+{
+    struct io_uring_params params;
+    memset(&params, '\0', sizeof(params));
+    int fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if(fd == -1)
+    {
+        DPRINTF("io_uring_setup failed: %s (%d)\n", strerror(errno), errno);
+        return EVENTMGR_URING_SETUP_FAILED;
+    }
+
+    /* EXT_ARG (5.11) gives us a timeout on io_uring_enter, RSRC_TAGS
+     * arrived in 5.13 alongside multishot poll */
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+        IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+    if((params.features & required) != required)
+    {
+        DPRINTF("io_uring lacks features: %x\n",
+            required & ~params.features);
+        close(fd);
+        return EVENTMGR_URING_SETUP_FAILED;
+    }
+
+    struct uring *r = (struct uring*)malloc(sizeof(struct uring));
+    if(r == NULL)
+    {
+        close(fd);
+        return EVENTMGR_URING_SETUP_FAILED;
+    }
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(r->ring == MAP_FAILED)
+    {
+        DPRINTF("mmap of io_uring failed: %s (%d)\n", strerror(errno), errno);
+        free(r);
+        close(fd);
+        return EVENTMGR_URING_SETUP_FAILED;
+    }
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+    {
+        DPRINTF("mmap of io_uring sqes failed: %s (%d)\n",
+            strerror(errno), errno);
+        munmap(r->ring, r->ring_len);
+        free(r);
+        close(fd);
+        return EVENTMGR_URING_SETUP_FAILED;
+    }
+
+    char *ring = (char*)r->ring;
+    r->sq_head = (unsigned*)(ring + params.sq_off.head);
+    r->sq_tail = (unsigned*)(ring + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(ring + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(ring + params.sq_off.array);
+    r->sq_entries = params.sq_entries;
+    r->cq_head = (unsigned*)(ring + params.cq_off.head);
+    r->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(ring + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    /* sqes are always used in ring order */
+    unsigned i;
+    for(i = 0;i < r->sq_entries;i++)
+        r->sq_array[i] = i;
+
+    loop->fd = fd;
+    loop->backend_data = r;
+    buf_ring_init(loop, r);
+    return EVENTMGR_SUCCESS;
+}
+
+static void uring_cleanup(eventloop loop)
+{
+    struct uring *r = (struct uring*)loop->backend_data;
+    buf_ring_cleanup(r);
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->ring, r->ring_len);
+    close(loop->fd);
+    free(r);
+    loop->backend_data = NULL;
+}
+
+static inline __u64 user_data(void *ptr, int tag)
+{
+    return (uintptr_t)ptr | tag;
+}
+
+/* EV_SUBMIT events only need a poll for EV_EXCEPT. Anything else is
+ * polled even with nothing to wait for, as with epoll errors and
+ * hangups are still reported */
+static inline char wants_poll(int events)
+{
+    return !(events & EV_SUBMIT) || events & EV_EXCEPT;
+}
+
+static inline char wants_submit(int events)
+{
+    return (events & (EV_SUBMIT | EV_READ)) == (EV_SUBMIT | EV_READ);
+}
+
+static unsigned poll_mask(int events)
+{
+    unsigned mask = 0;
+    /* EV_SUBMIT events do their own reading and writing */
+    if(!(events & EV_SUBMIT))
+    {
+        if(events & EV_READ)
+            mask |= POLLIN;
+        if(events & EV_WRITE)
+            mask |= POLLOUT;
+    }
+    if(events & EV_EXCEPT)
+        mask |= POLLERR;
+    return mask;
+}
+
+static int poll_arm(eventloop loop, event e)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if(sqe == NULL)
+        return EVENTMGR_URING_ENTER_FAILED;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = e->info.fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = poll_mask(e->backend_events);
+    sqe->user_data = user_data(e, URING_POLL);
+    e->polls++;
+    e->inflight++;
+    return EVENTMGR_SUCCESS;
+}
+
+static int submit_arm(eventloop loop, event e)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if(sqe == NULL)
+        return EVENTMGR_URING_ENTER_FAILED;
+    sqe->fd = e->info.fd;
+    if(e->info.accepted)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_RECV_GROUP;
+    }
+    sqe->user_data = user_data(e, URING_SUBMIT);
+    e->submits++;
+    e->inflight++;
+    return EVENTMGR_SUCCESS;
+}
+
+/* the cancelled request completes with -ECANCELED, which is what drops
+ * 'inflight'. The cancellation itself has no user_data and is ignored */
+static int uring_cancel(eventloop loop, event e, int tag)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if(sqe == NULL)
+        return EVENTMGR_URING_ENTER_FAILED;
+    sqe->opcode = tag == URING_POLL ?
+        IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data(e, tag);
+    sqe->user_data = 0;
+    return EVENTMGR_SUCCESS;
+}
+
+/* submission entries are processed in order, so a cancellation can
+ * only ever match the request it was meant for and not the one that
+ * replaces it */
+static int uring_update(eventloop loop, event e, int events)
+{
+    int old = e->backend_events;
+    int result = EVENTMGR_SUCCESS;
+    e->backend_events = events;
+
+    char poll_changed = wants_poll(old) != wants_poll(events) ||
+        poll_mask(old) != poll_mask(events);
+    if(poll_changed && wants_poll(old))
+        result = uring_cancel(loop, e, URING_POLL);
+    if(poll_changed && wants_poll(events) && result == EVENTMGR_SUCCESS)
+        result = poll_arm(loop, e);
+
+    if(wants_submit(old) == wants_submit(events) ||
+            result != EVENTMGR_SUCCESS)
+        return result;
+    if(wants_submit(old))
+        return uring_cancel(loop, e, URING_SUBMIT);
+    return submit_arm(loop, e);
+}
+
+static int uring_add(eventloop loop, event e)
+{
+    int result = EVENTMGR_SUCCESS;
+    e->backend_events = e->info.events;
+    if(wants_poll(e->backend_events))
+        result = poll_arm(loop, e);
+    if(wants_submit(e->backend_events) && result == EVENTMGR_SUCCESS)
+        result = submit_arm(loop, e);
+    return result;
+}
+
+static int uring_modify(eventloop loop, event e)
+{
+    return uring_update(loop, e, e->info.events);
+}
+
+static int uring_remove(eventloop loop, event e)
+{
+    int result = EVENTMGR_SUCCESS;
+    if(wants_poll(e->backend_events))
+        result = uring_cancel(loop, e, URING_POLL);
+    if(wants_submit(e->backend_events) && result == EVENTMGR_SUCCESS)
+        result = uring_cancel(loop, e, URING_SUBMIT);
+    return result;
+}
+
+static int uring_send(eventloop loop, struct event_send *send)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if(sqe == NULL)
+        return EVENTMGR_URING_ENTER_FAILED;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = send->event->info.fd;
+    sqe->addr = (uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = send->flags;
+    sqe->user_data = user_data(send, URING_SEND);
+    send->event->inflight++;
+    return EVENTMGR_SUCCESS;
+}
+
+static void poll_complete(eventloop loop, event e, struct io_uring_cqe *cqe)
+{
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        e->inflight--;
+        e->polls--;
+        /* the kernel may end a multishot poll by itself (e.g. when the
+         * completion queue overflows), in which case arm a new one
+         * unless a modify already replaced it */
+        if(cqe->res >= 0 && e->polls == 0 && !e->removed &&
+                wants_poll(e->backend_events))
+            poll_arm(loop, e);
+    }
+    if(cqe->res <= 0)
+        return;
+
+    int ready = 0;
+    if(cqe->res & (POLLIN | POLLHUP))
+        ready |= EV_READ;
+    if(cqe->res & POLLOUT)
+        ready |= EV_WRITE;
+    if(cqe->res & POLLERR)
+        ready |= EV_EXCEPT;
+    eventmanager_ready(e, ready);
+}
+
+static void submit_complete(eventloop loop, event e, struct io_uring_cqe *cqe)
+{
+    struct uring *r = (struct uring*)loop->backend_data;
+    int res = cqe->res;
+    if(e->info.accepted)
+    {
+        if(res != -ECANCELED)
+            eventmanager_accepted(e, res);
+    }
+    else if(cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        buffer *b = buf_ring_take(r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        b->used = res > 0 ? res : 0;
+        if(res > 0)
+            eventmanager_received(e, b, res);
+        else
+            buffer_recycle(b);
+    }
+    /* with nothing left in the ring the receive ends, and is armed
+     * again below. Only if the ring can't be refilled is the socket
+     * told */
+    else if(res == -ENOBUFS)
+    {
+        buf_ring_refill(r);
+        if(r->buffers_queued == 0)
+            eventmanager_received(e, NULL, res);
+    }
+    else if(res != -ECANCELED)
+        eventmanager_received(e, NULL, res);
+
+    if(cqe->flags & IORING_CQE_F_MORE)
+        return;
+    e->inflight--;
+    e->submits--;
+    /* ended by the kernel rather than by a modify, and still wanted */
+    if(res != -ECANCELED && e->submits == 0 && !e->removed &&
+            wants_submit(e->backend_events))
+        submit_arm(loop, e);
+}
+
+static void uring_complete(eventloop loop, struct io_uring_cqe *cqe)
+{
+    void *ptr = (void*)(uintptr_t)(cqe->user_data & ~(__u64)URING_TAG_MASK);
+    if(ptr == NULL)
+        return;
+
+    switch(cqe->user_data & URING_TAG_MASK)
+    {
+    case URING_POLL:
+        poll_complete(loop, (event)ptr, cqe);
+        break;
+    case URING_SUBMIT:
+        submit_complete(loop, (event)ptr, cqe);
+        break;
+    case URING_SEND:
+    {
+        struct event_send *send = (struct event_send*)ptr;
+        send->event->inflight--;
+        send->done(send, cqe->res);
+        break;
+    }
+    }
+}
+
+static int uring_wait(eventloop loop, int milliseconds)
+{
+    struct uring *r = (struct uring*)loop->backend_data;
+    if(r->missing_count)
+        buf_ring_refill(r);
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    /* completions are already waiting, so just hand over whatever was
+     * queued. With nothing to submit and no reason to block, this
+     * tick costs no syscall at all */
+    if(head != tail || milliseconds == 0)
+    {
+        int result = uring_submit(loop);
+        if(result != EVENTMGR_SUCCESS)
+            return result;
+    }
+    else
+    {
+        struct __kernel_timespec ts = {
+            .tv_sec = milliseconds / 1000,
+            .tv_nsec = (milliseconds % 1000) * 1000000LL,
+        };
+        struct io_uring_getevents_arg arg = {
+            .sigmask = 0,
+            .sigmask_sz = 0,
+            .ts = milliseconds < 0 ? 0 : (uintptr_t)&ts,
+        };
+        int result = sys_io_uring_enter(loop->fd, sq_queued(r), 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg));
+        if(result == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        {
+            DPRINTF("io_uring_enter failed: %s (%d)\n", strerror(errno), errno);
+            return EVENTMGR_URING_ENTER_FAILED;
+        }
+    }
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail)
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        uring_complete(loop, cqe);
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return EVENTMGR_SUCCESS;
+}
+
+const struct event_backend uring_backend =
+{
+    .name = "io_uring",
+    .init = uring_init,
+    .cleanup = uring_cleanup,
+    .add = uring_add,
+    .modify = uring_modify,
+    .remove = uring_remove,
+    .send = uring_send,
+    .wait = uring_wait,
+};
@@ -19,85 +19,184 @@
 
 #include "debug.h"
 
+#define MEMORY_BUDGET_HIGH  (256*1024*1024)
+#define MEMORY_BUDGET_LOW   (192*1024*1024)
+#define BUFFER_ARENA_SIZE   (64*1024*1024)
+/* free at most GC_STEP_BUDGET bytes of idle buffers every GC_INTERVAL ms */
+#define GC_INTERVAL         50
+#define GC_STEP_BUDGET      (256*1024)
+#define LISTEN_BACKLOG      1024
+
+/* what every request is answered with */
+#define RESPONSE_BODY       "Hello\n"
+
+struct connection
+{
+    Http http;
+    /* the last response has been queued, anything else that arrives
+     * is dropped */
+    char closing;
+};
+
+static void respond(Socket s, const char *status, const char *body,
+        char keep_alive)
+{
+    char response[256];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 %s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n%s",
+        status, strlen(body), keep_alive ? "keep-alive" : "close", body);
+    CALL((StringIO)s, write, response, len);
+}
+
+static void close_connection(Socket s, struct connection *conn)
+{
+    DPRINTF("calling 'send_eof'\n");
+    conn->closing = 1;
+    CALL(s, send_eof);
+}
+
+/* answers every message the parser has completed, a pipelined batch of
+ * them being parsed back to back as each one is reset */
+static void answer(Socket s, struct connection *conn)
+{
+    Http http = conn->http;
+    while(CALL(http, complete))
+    {
+        struct http_header *headers;
+        int header_count;
+        headers = CALL(http, get_headers, &header_count);
+        DPRINTF("Http headers: %d\n", header_count);
+        int i;
+        for(i = 0;i < header_count;i++)
+        {
+            DPRINTF("%.*s: %.*s\n",
+                    headers[i].name.len,
+                    HTTP_SLICE_PTR(&http->msg, headers[i].name),
+                    headers[i].value.len,
+                    HTTP_SLICE_PTR(&http->msg, headers[i].value));
+        }
+
+        char keep_alive = CALL(http, keep_alive);
+        respond(s, "200 OK", RESPONSE_BODY, keep_alive);
+        if(!keep_alive)
+        {
+            close_connection(s, conn);
+            return;
+        }
+        CALL(http, reset);
+    }
+    if(http->error)
+    {
+        respond(s, "400 Bad Request", "", 0);
+        close_connection(s, conn);
+    }
+}
+
 static void data_available(Socket s)
 {
-    Http http = (Http)s->info.context;
-    if(!http)
+    struct connection *conn = (struct connection*)s->info.context;
+    if(!conn)
     {
-        http = NEW(Http);
-        http->state = 1;
-        s->info.context = http;
+        conn = (struct connection*)calloc(1, sizeof(struct connection));
+        conn->http = NEW(Http);
+        s->info.context = conn;
     }
 
+    /* responses are only queued here, so everything answered in one
+     * call goes out in a single gathered write once the loop gets to
+     * the socket's write */
     buffer *b;
     while( (b = CALL((StringIO)s, read_buffer)) )
     {
-        //CALL((StringIO)s, write_buffer, b);
-        CALL(http, feed_data, b);
-        char ***headers;
-        int header_count;
-        headers = CALL(http, get_headers, &header_count);
-        if(headers)
+        if(conn->closing)
         {
-            DPRINTF("Http headers: %d\n", header_count);
-            int i;
-            for(i = 0;i < header_count;i++)
-            {
-                DPRINTF("%s: %s\n", headers[i][0], headers[i][1]);
-            }
-            CALL(s, send_eof);
+            buffer_recycle(b);
+            continue;
         }
+        CALL(conn->http, feed_data, b);
+        answer(s, conn);
     }
 
-    if(CALL(s, eof))
+    if(CALL(s, eof) && !conn->closing)
     {
-        DPRINTF("calling 'send_eof'\n");
-        CALL(s, send_eof);
+        CALL(conn->http, feed_eof);
+        close_connection(s, conn);
     }
 }
 
 static void on_free(Socket s)
 {
     DPRINTF("socket is being freed!\n");
-    if(s->info.context)
-        DELETE(s->info.context);
+    struct connection *conn = (struct connection*)s->info.context;
+    if(conn)
+    {
+        DELETE(conn->http);
+        free(conn);
+    }
 }
 
 int handle_count = 0;
-static int accept_callback(event e, struct event_info *info)
+static int on_accept(Listener listener, struct socket_info *info)
 {
     DPRINTF("accepting client\n");
-    struct sockaddr_in client;
-    socklen_t sockaddr_len = sizeof(client);
-    int fd = accept(info->fd, (struct sockaddr*)&client, &sockaddr_len);
-    if(fd == -1)
-    {
-        if(errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-            return EV_DONE;
-        }
-        if(errno == ECONNABORTED)
-        {
-            return EV_READ_PENDING;
-        }
-        DPRINTF("error accepting connection: %s (%d)\n", strerror(errno), errno);
-        event_deregister(e);
-        return EV_DONE;
-    }
+    info->data_available = data_available;
+    info->on_free = on_free;
+    __sync_fetch_and_add(&handle_count, 1);
+    return 0;
+}
 
-    struct socket_info sock_info = {
-        .sock_fd = fd,
-        .context = NULL,
-        .data_available = data_available,
-        .on_free = on_free,
+static void garbage_collect(event_timer timer, void *context)
+{
+    buffer_gc_step(GC_STEP_BUDGET);
+    event_timer_arm(timer, GC_INTERVAL);
+}
+
+/* per event loop state */
+struct loop_state
+{
+    Listener listener;
+    event_timer gc;
+};
+
+static unsigned short port;
+static struct loop_state *loop_states;
+
+static int loop_setup(eventloop loop, int index, void *context)
+{
+    struct loop_state *state = &loop_states[index];
+
+    /* every loop gets its own listening socket on the same port;
+     * SO_REUSEPORT lets the kernel shard connections between them */
+    struct listener_info listener_info = {
+        .loop = loop,
+        .port = port,
+        .backlog = LISTEN_BACKLOG,
+        .on_accept = on_accept,
     };
+    state->listener = NEW(Listener, &listener_info);
+    if(!state->listener)
+        return -1;
+    DPRINTF("loop %d using %s\n", index, eventmanager_backend_name(loop));
 
-    handle_count++;
-    NEW(Socket, &sock_info);
-    return EV_READ_PENDING;
+    event_timer_register(loop, garbage_collect, NULL, &state->gc);
+    event_timer_arm(state->gc, GC_INTERVAL);
+
+    /* have some socket buffers ready before the first connection */
+    buffer_pool_warm(SOCKET_BUFFER_SIZE, 32);
+    return 0;
 }
 
-int quit = 0;
+static void loop_teardown(eventloop loop, int index, void *context)
+{
+    struct loop_state *state = &loop_states[index];
+
+    DELETE(state->listener);
+    event_timer_deregister(state->gc);
+    socket_free_all();
+    buffer_garbage_collect(0);
+}
+
+volatile int quit = 0;
 void sigint_handler(int sig)
 {
     quit = 1;
@@ -105,74 +204,36 @@ void sigint_handler(int sig)
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2)
-    {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return 1;
-    }
-    eventmanager_init();
-
-    int sfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sfd == -1)
+    if(argc < 2 || argc > 4)
     {
-        DPRINTF("socket() failed: %s (%d)\n", strerror(errno), errno);
+        fprintf(stderr, "Usage: %s <port> [loops] [epoll|io_uring]\n", argv[0]);
         return 1;
     }
-    struct sockaddr_in self = {
-        .sin_family = AF_INET,
-        .sin_port = htons(atoi(argv[1])),
-        .sin_addr = { INADDR_ANY },
-    };
-    if(bind(sfd, (const struct sockaddr*)&self, sizeof(self)) == -1)
-    {
-        DPRINTF("bind() failed: %s (%d)\n", strerror(errno), errno);
-        return 1;
-    }
-    if(listen(sfd, 32) == -1)
-    {
-        DPRINTF("listen() failed: %s (%d)\n", strerror(errno), errno);
-    }
+    port = atoi(argv[1]);
+    int loops = argc >= 3 ? atoi(argv[2]) : 1;
+    if(loops < 1)
+        loops = 1;
+    int backend = EVENTMGR_BACKEND_EPOLL;
+    if(argc == 4 && strcmp(argv[3], "io_uring") == 0)
+        backend = EVENTMGR_BACKEND_IO_URING;
 
-    fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL, 0) | O_NONBLOCK);
+    loop_states = (struct loop_state*)calloc(loops, sizeof(struct loop_state));
 
-    struct event_info info = {
-        .fd = sfd,
-        .events = EV_READ | EV_EXCEPT,
-        .context = NULL,
-        .read = accept_callback,
-        .write = NULL,
-        .except = NULL,
-        .alarm = NULL,
-    };
+    signal(SIGINT, sigint_handler);
 
-    event e;
-    event_register(&info, &e);
+    if(buffer_arena_init(BUFFER_ARENA_SIZE, 0) == -1)
+        DPRINTF("buffer arena unavailable, using malloc\n");
 
-    int garbage_collect(event e, struct event_info *info)
-    {
-        buffer_garbage_collect(10);
-        event_alarm(e, 1000);
-        return EV_DONE;
-    }
-    info = (struct event_info){
-        .fd = -1,
-        .alarm = garbage_collect,
-    };
-    event gc;
-    event_register(&info, &gc);
-    event_alarm(gc, 1000);
-
-    signal(SIGINT, sigint_handler);
+    /* stop reading from clients once buffers take up more than this */
+    buffer_set_limit(MEMORY_BUDGET_HIGH, MEMORY_BUDGET_LOW);
 
-    while(!quit)
-    {
-        eventmanager_tick(1000);
-    }
+    int result = eventmanager_run_threads(
+            loops, backend, loop_setup, loop_teardown, NULL, &quit);
+    if(result != EVENTMGR_SUCCESS)
+        DPRINTF("event loops exited: %s (%d)\n",
+            eventmanager_strerror(result), result);
 
-    event_deregister(e);
-    socket_free_all();
-    buffer_garbage_collect(0);
-    eventmanager_cleanup();
+    free(loop_states);
 
     DPRINTF("total connections handled: %d\n", handle_count);
 
@@ -0,0 +1,82 @@
+/* Pipelined requests on one Http: stray line ends between messages
+ * (RFC 7230 3.5) are skipped rather than parsed as an empty request,
+ * whichever buffers the input is split across. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffermanager.h"
+#include "http_parser.h"
+
+static const char input[] =
+    "\r\n"
+    "POST /x HTTP/1.1\r\nHost: a\r\nContent-Length: 3\r\n\r\nabc\r\n"
+    "GET /y HTTP/1.1\r\nHost: a\r\n\r\n"
+    "\r\n\n\r\n"
+    "GET /z HTTP/1.1\r\nHost: a\r\n\r\n";
+
+static const char *paths[] = { "/x", "/y", "/z" };
+#define PATH_COUNT  (int)(sizeof(paths) / sizeof(paths[0]))
+
+static int failed;
+
+static void check(int ok, const char *what, size_t split)
+{
+    if(ok)
+        return;
+    fprintf(stderr, "split at %zu: %s\n", split, what);
+    failed = 1;
+}
+
+static void feed(Http http, const char *p, size_t len)
+{
+    if(len == 0)
+        return;
+    buffer *b = buffer_get(len);
+    memcpy(b->ptr, p, len);
+    b->used = len;
+    CALL(http, feed_data, b);
+}
+
+/* takes every request that's complete, returns how many there were
+ * so far */
+static int take(Http http, int seen, size_t split)
+{
+    while(CALL(http, complete))
+    {
+        struct http_slice path = http->msg.request_path;
+        check(seen < PATH_COUNT, "more requests than were sent", split);
+        if(seen < PATH_COUNT)
+            check(path.len == strlen(paths[seen]) &&
+                memcmp(HTTP_SLICE_PTR(&http->msg, path), paths[seen],
+                    path.len) == 0, "wrong request", split);
+        check(CALL(http, keep_alive), "keep-alive lost", split);
+        seen++;
+        CALL(http, reset);
+    }
+    return seen;
+}
+
+int main(void)
+{
+    size_t len = sizeof(input) - 1;
+    size_t split;
+    /* every way of cutting the input in two, and once in one piece */
+    for(split = 0;split < len;split++)
+    {
+        Http http = NEW(Http);
+        feed(http, input, split);
+        int seen = take(http, 0, split);
+        feed(http, input + split, len - split);
+        seen = take(http, seen, split);
+        check(seen == PATH_COUNT, "requests missing", split);
+        check(http->error == HTTP_ERR_NONE, "parse error", split);
+        /* closing between messages isn't an error */
+        CALL(http, feed_eof);
+        check(http->error == HTTP_ERR_NONE, "eof counted as truncated", split);
+        DELETE(http);
+    }
+    buffer_garbage_collect(0);
+    return failed;
+}
@@ -0,0 +1,44 @@
+/* eventmanager_run_threads: a loop whose setup fails is reported as a
+ * failure, and the loops that did start are stopped rather than left
+ * serving without it. */
+
+#include <stdio.h>
+
+#include "eventmanager.h"
+
+static int failing_index;
+
+static int setup(eventloop loop, int index, void *context)
+{
+    (void)loop;
+    (void)context;
+    return index == failing_index ? -1 : 0;
+}
+
+static int run(int count, int fail)
+{
+    volatile int quit = 0;
+    int result;
+
+    failing_index = fail;
+    result = eventmanager_run_threads(count, EVENTMGR_BACKEND_EPOLL,
+            setup, NULL, NULL, &quit);
+    if(result != EVENTMGR_THREAD_FAILED)
+    {
+        fprintf(stderr, "%d loops, loop %d failing: got %d (%s)\n",
+                count, fail, result, eventmanager_strerror(result));
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed |= run(1, 0);
+    /* without the failing loop setting quit these never return */
+    failed |= run(2, 0);
+    failed |= run(3, 2);
+    return failed;
+}